@@ -1,18 +1,91 @@
+#include <algorithm>
 #include <iostream>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <random>
+#include <set>
 #include <string>
 #include <libgen.h>
 #include <sstream>
 #include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <dirent.h>
+#include <exception>
 #include <string>
+#include <stdexcept>
 #include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <csignal>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 
+/**
+ * USDT probes under the provider "fsynctest", e.g.
+ *   bpftrace -e 'usdt:./fsynctest:fsynctest:phase__end { ... }'
+ * Without <sys/sdt.h> they compile to nothing; with it every probe site
+ * is a single nop until a tracer attaches.
+ *
+ *   commit__begin(directory, name, size)
+ *   commit__end(directory, name, size, errno)
+ *   phase__begin(directory, name, phase)
+ *   phase__end(directory, name, phase)
+ *   read__begin(path)
+ *   read__end(path, size, errno)
+ *   cleanup__begin(directory, name)
+ *   cleanup__end(directory, name, removed)
+ *
+ * phase is the numeric CommitPhase, errno is 0 on success.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FSYNCTEST_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef FSYNCTEST_HAVE_SDT
+#define FSYNCTEST_PROBE1(name, a1) DTRACE_PROBE1(fsynctest, name, a1)
+#define FSYNCTEST_PROBE2(name, a1, a2) DTRACE_PROBE2(fsynctest, name, a1, a2)
+#define FSYNCTEST_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(fsynctest, name, a1, a2, a3)
+#define FSYNCTEST_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(fsynctest, name, a1, a2, a3, a4)
+#else
+/**
+ * sizeof keeps the arguments referenced without evaluating them
+ */
+#define FSYNCTEST_PROBE1(name, a1) do { (void)sizeof(a1); } while (0)
+#define FSYNCTEST_PROBE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define FSYNCTEST_PROBE3(name, a1, a2, a3) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define FSYNCTEST_PROBE4(name, a1, a2, a3, a4) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while (0)
+#endif
+
 namespace
 {
     std::chrono::time_point<std::chrono::steady_clock> getElapsedTimeMonitorTimestamp()
@@ -46,23 +119,184 @@ namespace
     // With C++17 this can be removed and template class itself can be named ElapsedTimeMonitor
     using ElapsedTimeMonitor = ElapsedTimeMonitorImpl<>;
 
-    class CommittedFile
+    enum class CommitPhase
+    {
+        OPEN,
+        WRITE,
+        SYNC,
+        RENAME,
+        DIRECTORY_SYNC
+    };
+
+    const char* commitPhaseName(CommitPhase phase)
+    {
+        switch (phase)
+        {
+        case CommitPhase::OPEN: return "open";
+        case CommitPhase::WRITE: return "write";
+        case CommitPhase::SYNC: return "sync";
+        case CommitPhase::RENAME: return "rename";
+        case CommitPhase::DIRECTORY_SYNC: return "dirsync";
+        }
+        return "unknown";
+    }
+
+    /**
+     * Index of a path in the PathTable
+     */
+    typedef uint32_t PathId;
+
+    /**
+     * Instrumentation hooks called by CommittedFile::write from the
+     * committing thread. Observers are registered before any commits
+     * start and must outlive them, so that the commit path can walk the
+     * list without locking. Paths are passed as their PathTable id,
+     * PathTable::path() turns one into a string where needed.
+     */
+    class CommitObserver
     {
     public:
-        explicit CommittedFile(const std::string& filePath);
+        virtual ~CommitObserver() {}
+
+        virtual void commitBegin(PathId /*id*/, size_t /*size*/) {}
+
+        virtual void phaseBegin(PathId /*id*/, CommitPhase /*phase*/) {}
+
+        virtual void phaseEnd(PathId /*id*/, CommitPhase /*phase*/) {}
+
+        /**
+         * error is the errno of a failed commit or 0
+         */
+        virtual void commitEnd(PathId /*id*/, int /*error*/) {}
+
+        /**
+         * Called by CommittedFile::read
+         */
+        virtual void readBegin(PathId /*id*/) {}
+
+        /**
+         * A newer commit to the same path was published first, so this
+         * one skipped its rename. Called between commitBegin and
+         * commitEnd.
+         */
+        virtual void commitElided(PathId /*id*/) {}
+    };
+
+    std::vector<CommitObserver*>& commitObservers()
+    {
+        static std::vector<CommitObserver*> observers;
+        return observers;
+    }
 
-        virtual ~CommittedFile();
+    void addCommitObserver(CommitObserver& observer)
+    {
+        commitObservers().push_back(&observer);
+    }
+
+    void removeCommitObserver(CommitObserver& observer)
+    {
+        auto& observers(commitObservers());
+        observers.erase(std::remove(observers.begin(), observers.end(), &observer), observers.end());
+    }
+
+    class CommitPhaseScope
+    {
+    public:
+        CommitPhaseScope(PathId id,
+                         const std::string& directory,
+                         const char* fileName,
+                         CommitPhase phase):
+            id(id),
+            directory(directory),
+            fileName(fileName),
+            phase(phase),
+            active(!commitObservers().empty()),
+            ended(false)
+        {
+            FSYNCTEST_PROBE3(phase__begin, directory.c_str(), fileName, static_cast<int>(phase));
+            if (active)
+                for (auto observer: commitObservers())
+                    observer->phaseBegin(id, phase);
+        }
 
-        virtual std::string read() const;
+        ~CommitPhaseScope()
+        {
+            end();
+        }
 
-        virtual void write(const std::string& data);
+        void end()
+        {
+            if (ended)
+                return;
+            ended = true;
+            FSYNCTEST_PROBE3(phase__end, directory.c_str(), fileName, static_cast<int>(phase));
+            if (!active)
+                return;
+            for (auto observer: commitObservers())
+                observer->phaseEnd(id, phase);
+        }
 
-        virtual std::string getPath() const;
+        CommitPhaseScope(const CommitPhaseScope&) = delete;
+        CommitPhaseScope& operator=(const CommitPhaseScope&) = delete;
 
     private:
-        void cleanup();
+        const PathId id;
+        const std::string& directory;
+        const char* fileName;
+        const CommitPhase phase;
+        const bool active;
+        bool ended;
+    };
+
+    enum class CommitMode: uint8_t
+    {
+        /**
+         * Rename work-file over the real file. Previous version is lost.
+         */
+        REPLACE,
+        /**
+         * Exchange work-file with the real file (renameat2 with
+         * RENAME_EXCHANGE) and rename the old version to <name>.prev, so
+         * that it can be restored with CommittedFile::rollback() without
+         * copying any data.
+         */
+        KEEP_PREVIOUS
+    };
+
+    enum class Durability: uint8_t
+    {
+        /**
+         * write() returns once the new version is on disk
+         */
+        IMMEDIATE,
+        /**
+         * write() only makes the new version visible atomically. It is
+         * on disk after the next durabilityBarrier().
+         */
+        DEFERRED,
+        /**
+         * Like IMMEDIATE, but directory fsyncs of concurrent commits to
+         * the same directory are shared through the GroupCommitter.
+         */
+        GROUPED
+    };
+
+    struct CommitOptions
+    {
+        CommitOptions():
+            mode(CommitMode::REPLACE),
+            durability(Durability::IMMEDIATE),
+            createDirectories(false)
+        {
+        }
 
-        std::string filePath;
+        CommitMode mode;
+        Durability durability;
+        /**
+         * Create missing directories of the path durably with
+         * ensureDirectory() when the CommittedFile is constructed
+         */
+        bool createDirectories;
     };
 
     std::string buildCommittedFileError(const std::string& func,
@@ -91,270 +325,8291 @@ namespace
         return os.str();
     }
 
-    class BaseFd
+    /**
+     * Failure of a single file operation. Kept separate from the message
+     * so that the non-throwing paths only pay for formatting when
+     * someone asks.
+     */
+    struct IoError
+    {
+        const char* func;
+        /**
+         * Empty for errors of whole-path operations like readFile(),
+         * which are reported against file1 alone
+         */
+        std::string directory;
+        std::string file1;
+        std::string file2;
+        int error;
+
+        /**
+         * Whether retrying later could succeed, e.g. after space has
+         * been freed or a signal interrupted us
+         */
+        bool retryable() const
+        {
+            return (error == EINTR) || (error == EAGAIN) || (error == EBUSY) ||
+                (error == ENOSPC) || (error == EDQUOT);
+        }
+
+        std::string message() const
+        {
+            return directory.empty() ?
+                buildCommittedFileReadError(func, file1, error) :
+                buildCommittedFileError(func, directory, file1, file2, error);
+        }
+
+        [[noreturn]] void raise() const
+        {
+            throw std::system_error(error, std::system_category(), message().c_str());
+        }
+    };
+
+    /**
+     * Outcome of a non-throwing file operation. Success does not
+     * allocate.
+     */
+    class IoStatus
     {
     public:
-        BaseFd(const std::string& directory,
-               const std::string& file,
-               int fd);
+        IoStatus() {}
 
-        virtual ~BaseFd();
+        static IoStatus failure(const char* func,
+                                const std::string& directory,
+                                const std::string& file1,
+                                const std::string& file2,
+                                int error)
+        {
+            IoStatus status;
+            status.failed = std::make_shared<IoError>(IoError{ func, directory, file1, file2, error });
+            return status;
+        }
 
-        void sync();
+        /**
+         * Uses errno
+         */
+        static IoStatus fromErrno(const char* func,
+                                  const std::string& directory,
+                                  const std::string& file1,
+                                  const std::string& file2)
+        {
+            return failure(func, directory, file1, file2, errno);
+        }
 
-        void close();
+        bool ok() const { return !failed; }
 
-        operator int() const noexcept { return fd; }
+        explicit operator bool() const { return ok(); }
 
-        BaseFd(const BaseFd&) = delete;
-        BaseFd(BaseFd&&) = delete;
-        BaseFd& operator=(const BaseFd&) = delete;
-        BaseFd& operator=(BaseFd&&) = delete;
+        /**
+         * Only valid if !ok()
+         */
+        const IoError& error() const { return *failed; }
 
-        const std::string directory;
-        const std::string file;
-        int fd;
+        /**
+         * Throws std::system_error if the operation failed
+         */
+        void check() const
+        {
+            if (failed)
+                failed->raise();
+        }
+
+    private:
+        std::shared_ptr<const IoError> failed;
     };
 
-    class DirFd: public BaseFd
+    template <typename T>
+    class IoResult
     {
     public:
-        DirFd(const std::string& directory);
+        IoResult(T value):
+            result(std::move(value))
+        {
+        }
 
-        void unlink(const std::string& file);
+        IoResult(IoStatus status):
+            result(),
+            status(std::move(status))
+        {
+        }
 
-        void renameFile(const std::string& oldFile, const std::string& newFile);
+        bool ok() const { return status.ok(); }
+
+        explicit operator bool() const { return ok(); }
+
+        const IoStatus& getStatus() const { return status; }
+
+        /**
+         * Only valid if ok()
+         */
+        T& value() { return result; }
+
+        /**
+         * Returns the value or throws std::system_error
+         */
+        T take()
+        {
+            status.check();
+            return std::move(result);
+        }
 
     private:
-        static const std::string NO_FILE;
+        T result;
+        IoStatus status;
     };
 
-    class WriteFd: public BaseFd
+    /**
+     * Any number of CommittedFile objects and threads may write the same
+     * path concurrently. Each commit uses its own work-file and the
+     * version that started last wins: a commit that finds a newer one
+     * already renamed into place skips its rename. write() returns once
+     * the data of this or a newer commit is durable.
+     *
+     * A CommittedFile is only a handle into the PathTable, a few bytes
+     * that can be copied freely. Committing does not allocate, observers
+     * are told the PathId rather than the path.
+     */
+    class CommittedFile
     {
     public:
-        WriteFd(DirFd& dirFd, const std::string& file);
+        explicit CommittedFile(const std::string& filePath,
+                               const CommitOptions& options = CommitOptions());
 
-        void writeAll(const void* data, size_t size);
+        ~CommittedFile();
+
+        /**
+         * The try-variants report failures through the result instead of
+         * throwing. read() and write() throw std::system_error.
+         */
+        IoResult<std::string> tryRead() const;
+
+        std::string read() const;
+
+        IoStatus tryWrite(const std::string& data);
+
+        void write(const std::string& data);
+
+        /**
+         * Atomically swap <name>.prev and the real file. Calling rollback()
+         * twice restores the original state. Throws ENOENT if either file
+         * is missing.
+         */
+        void rollback();
+
+        std::string getPath() const;
+
+    private:
+        IoStatus commit(const std::string& data);
+
+        PathId id;
+        CommitOptions options;
     };
 
-    std::string dirName(const std::string& filePath)
+    /**
+     * The system calls used by the file classes below. Everything goes
+     * through the installed backend so that the commit protocol can be
+     * run against injected latencies or entirely in memory. All methods
+     * follow the libc convention of returning -1 and setting errno on
+     * failure.
+     */
+    class SyscallBackend
     {
-        char buffer[filePath.size() + 1];
-        memcpy(buffer, filePath.c_str(), filePath.size() + 1);
-        return dirname(buffer);
-    }
+    public:
+        virtual ~SyscallBackend() {}
 
-    std::string baseName(const std::string& filePath)
-    {
-        char buffer[filePath.size() + 1];
-        memcpy(buffer, filePath.c_str(), filePath.size() + 1);
-        return basename(buffer);
-    }
+        virtual int openat(int dirFd, const char* path, int flags, mode_t mode) = 0;
 
-    std::string readFile(const std::string& filePath)
-    {
-        auto fd(open(filePath.c_str(), O_RDONLY | O_CLOEXEC));
-        if (fd == -1)
-            throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", filePath, errno).c_str());
+        virtual int close(int fd) = 0;
 
-        std::ostringstream os;
-        char buffer[4096] = {};
-        ssize_t len = 0;
-        while ((len = read(fd, &buffer, sizeof(buffer))) > 0)
-            os << std::string(buffer, static_cast<size_t>(len));
+        virtual ssize_t read(int fd, void* buffer, size_t size) = 0;
 
-        const int savedErrno(errno);
-        close(fd);
-        if (len < 0)
-            throw std::system_error(savedErrno, std::system_category(), buildCommittedFileReadError("read", filePath, savedErrno).c_str());
+        virtual ssize_t write(int fd, const void* data, size_t size) = 0;
 
-        return os.str();
-    }
+        virtual ssize_t pwrite(int fd, const void* data, size_t size, off_t offset) = 0;
 
-    std::string getRandomData()
-    {
-        auto now(std::chrono::system_clock::now());
-        auto nowTimeT(std::chrono::system_clock::to_time_t(now));
-        return std::ctime(&nowTimeT);
+        virtual off_t lseek(int fd, off_t offset, int whence) = 0;
 
-    }
-}
+        virtual int ftruncate(int fd, off_t length) = 0;
 
-void usage()
-{
-    std::cout << "Usage: fsynctest <filename> <count>" << std::endl;
-    exit(0);
-}
+        virtual int fstat(int fd, struct stat* st) = 0;
 
-void writeFile(const std::string& filename)
-{
-    ElapsedTimeMonitor dummy("Write file");
-    CommittedFile cf(filename);
-    cf.write(getRandomData());
-}
+        virtual int fsync(int fd) = 0;
 
-int main(int argc, const char* argv[])
-{
-    if (argc != 3)
-        usage();
+        virtual int fdatasync(int fd) = 0;
 
-    std::string filename = argv[1];
-    long count(std::atoi(argv[2]));
-    if (count < 1)
-        usage();
-    for(long i = 0; i < count; ++i)
-        writeFile(filename);
-}
+        virtual int syncfs(int fd) = 0;
 
-BaseFd::BaseFd(const std::string& directory,
-               const std::string& file,
-               int fd):
-    directory(directory),
-    file(file),
-    fd(fd)
-{
-}
+        /**
+         * renameat2(), flags 0 is plain renameat()
+         */
+        virtual int renameat(int oldDirFd, const char* oldPath, int newDirFd, const char* newPath, unsigned int flags) = 0;
 
-BaseFd::~BaseFd()
-{
-    if (fd >= 0)
-        /* Ignore errors */
-        ::close(fd);
-}
+        virtual int unlinkat(int dirFd, const char* path, int flags) = 0;
+
+        virtual int mkdirat(int dirFd, const char* path, mode_t mode) = 0;
+
+        virtual int symlinkat(const char* target, int dirFd, const char* path) = 0;
 
-void BaseFd::sync()
-{
-    if (::fsync(fd) == -1)
         /**
-         * @todo In theory ENOSPC and EDQUOT errors could be recovered
-         * by retrying later. If there is such retry logic at upper
-         * layer, then we should indicate that retrying is worth it in
-         * the exception. Currently that sounds very unlikely.
+         * Lists an open directory as (name, is directory) pairs, without
+         * "." and "..".
          */
-        throw std::system_error(errno, std::system_category(), buildCommittedFileError("fsync", directory, file, "", errno).c_str());
-}
+        virtual int readDirectory(int dirFd, std::vector<std::pair<std::string, bool>>& entries) = 0;
+    };
 
-void BaseFd::close()
-{
-    if (fd >= 0)
+    class PosixSyscallBackend: public SyscallBackend
     {
-        const int copy(fd);
-        fd = -1;
-        if (::close(copy) == -1)
-            throw std::system_error(errno, std::system_category(), buildCommittedFileError("close", directory, file, "", errno).c_str());
-    }
-}
+    public:
+        int openat(int dirFd, const char* path, int flags, mode_t mode) override { return ::openat(dirFd, path, flags, mode); }
 
-const std::string DirFd::NO_FILE;
+        int close(int fd) override { return ::close(fd); }
 
-DirFd::DirFd(const std::string& directory):
-    BaseFd(directory,
-           NO_FILE,
-           ::open(directory.c_str(), O_RDONLY | O_CLOEXEC))
-{
-    if (fd == -1)
-        throw std::system_error(errno, std::system_category(), buildCommittedFileError("open", directory, "", "", errno).c_str());
-}
+        ssize_t read(int fd, void* buffer, size_t size) override { return ::read(fd, buffer, size); }
 
-void DirFd::unlink(const std::string& file)
-{
-    if ((::unlinkat(fd, file.c_str(), 0) == -1) && (errno != ENOENT))
-        throw std::system_error(errno, std::system_category(), buildCommittedFileError("unlink", directory, file, "", errno).c_str());
-}
+        ssize_t write(int fd, const void* data, size_t size) override { return ::write(fd, data, size); }
 
-void DirFd::renameFile(const std::string& oldFile, const std::string& newFile)
-{
-    if (::renameat(fd,
-                 oldFile.c_str(),
-                 fd,
-                 newFile.c_str()) == -1)
-        throw std::system_error(errno, std::system_category(), buildCommittedFileError("rename", directory, oldFile, newFile, errno).c_str());
-}
+        ssize_t pwrite(int fd, const void* data, size_t size, off_t offset) override { return ::pwrite(fd, data, size, offset); }
 
-WriteFd::WriteFd(DirFd& dirFd, const std::string& file):
-    BaseFd(dirFd.directory,
-           file,
-           ::openat(dirFd,
-                    file.c_str(),
-                    O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
-                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH))
-{
-    if (fd == -1)
-        throw std::system_error(errno, std::system_category(), buildCommittedFileError("open", directory, file, "", errno).c_str());
-}
+        off_t lseek(int fd, off_t offset, int whence) override { return ::lseek(fd, offset, whence); }
 
-void WriteFd::writeAll(const void* data, size_t size)
-{
-    size_t written(0);
-    while (written < size)
-    {
-        const ssize_t ret(::write(fd, static_cast<const char*>(data) + written, size - written));
-        if (ret < 0)
-            /**
-             * @todo In theory ENOSPC and EDQUOT errors could be recovered
-             * by retrying later. If there is such retry logic at upper
-             * layer, then we should indicate that retrying is worth it in
-             * the exception. Currently that sounds very unlikely.
-             */
-            throw std::system_error(errno, std::system_category(), buildCommittedFileError("write", directory, file, "", errno).c_str());
-        else
-            written += static_cast<size_t>(ret);
+        int ftruncate(int fd, off_t length) override { return ::ftruncate(fd, length); }
+
+        int fstat(int fd, struct stat* st) override { return ::fstat(fd, st); }
+
+        int fsync(int fd) override { return ::fsync(fd); }
+
+        int fdatasync(int fd) override { return ::fdatasync(fd); }
+
+        int syncfs(int fd) override { return ::syncfs(fd); }
+
+        int renameat(int oldDirFd, const char* oldPath, int newDirFd, const char* newPath, unsigned int flags) override
+        {
+            return flags ? ::renameat2(oldDirFd, oldPath, newDirFd, newPath, flags) : ::renameat(oldDirFd, oldPath, newDirFd, newPath);
+        }
+
+        int unlinkat(int dirFd, const char* path, int flags) override { return ::unlinkat(dirFd, path, flags); }
+
+        int mkdirat(int dirFd, const char* path, mode_t mode) override { return ::mkdirat(dirFd, path, mode); }
+
+        int symlinkat(const char* target, int dirFd, const char* path) override { return ::symlinkat(target, dirFd, path); }
+
+        int readDirectory(int dirFd, std::vector<std::pair<std::string, bool>>& entries) override;
+    };
+
+    /**
+     * Process-private filesystem kept in memory. Nothing ever blocks, so
+     * what is left of commit latency is the engine's own overhead.
+     * Relative paths are resolved against a virtual "." that has no
+     * relation to the real working directory.
+     */
+    class MemorySyscallBackend: public SyscallBackend
+    {
+    public:
+        MemorySyscallBackend();
+
+        /**
+         * mkdir -p, for setting up the directories a test expects
+         */
+        void createDirectories(const std::string& path);
+
+        int openat(int dirFd, const char* path, int flags, mode_t mode) override;
+
+        int close(int fd) override;
+
+        ssize_t read(int fd, void* buffer, size_t size) override;
+
+        ssize_t write(int fd, const void* data, size_t size) override;
+
+        ssize_t pwrite(int fd, const void* data, size_t size, off_t offset) override;
+
+        off_t lseek(int fd, off_t offset, int whence) override;
+
+        int ftruncate(int fd, off_t length) override;
+
+        int fstat(int fd, struct stat* st) override;
+
+        int fsync(int fd) override { return checkFd(fd); }
+
+        int fdatasync(int fd) override { return checkFd(fd); }
+
+        int syncfs(int fd) override { return checkFd(fd); }
+
+        int renameat(int oldDirFd, const char* oldPath, int newDirFd, const char* newPath, unsigned int flags) override;
+
+        int unlinkat(int dirFd, const char* path, int flags) override;
+
+        int mkdirat(int dirFd, const char* path, mode_t mode) override;
+
+        int symlinkat(const char* target, int dirFd, const char* path) override;
+
+        int readDirectory(int dirFd, std::vector<std::pair<std::string, bool>>& entries) override;
+
+    private:
+        struct Node
+        {
+            enum class Type { FILE, DIRECTORY, SYMLINK };
+
+            Type type;
+            ino_t inode;
+            std::shared_ptr<std::string> data;
+            std::string target;
+        };
+
+        struct OpenFile
+        {
+            std::string path;
+            ino_t inode;
+            bool directory;
+            std::shared_ptr<std::string> data;
+            off_t position;
+        };
+
+        int checkFd(int fd);
+
+        /**
+         * Returns false with errno set if the path cannot be resolved
+         */
+        bool resolve(int dirFd, const char* path, bool followLast, std::string& resolved) const;
+
+        static std::string normalize(const std::string& path);
+
+        static std::string parentOf(const std::string& path);
+
+        bool hasChildren(const std::string& path) const;
+
+        void move(const std::string& from, const std::string& to);
+
+        int fail(int error) const
+        {
+            errno = error;
+            return -1;
+        }
+
+        mutable std::mutex mutex;
+        std::map<std::string, Node> nodes;
+        std::map<int, OpenFile> files;
+        int nextFd;
+        ino_t nextInode;
+    };
+
+    enum class SyscallClass
+    {
+        OPEN,
+        CLOSE,
+        READ,
+        WRITE,
+        SYNC,
+        RENAME,
+        UNLINK,
+        MKDIR,
+        COUNT
+    };
+
+    class LatencyDistribution
+    {
+    public:
+        LatencyDistribution();
+
+        /**
+         * One of fixed:<t>, uniform:<min>:<max>, exp:<mean> or
+         * lognormal:<median>:<sigma>. Times take us, ms or s suffixes and
+         * default to microseconds. Throws std::invalid_argument.
+         */
+        static LatencyDistribution parse(const std::string& spec);
+
+        /**
+         * Same forms with values read by parseValue, e.g. sizes
+         */
+        static LatencyDistribution parse(const std::string& spec, double (*parseValue)(const std::string&));
+
+        std::chrono::nanoseconds sample(std::mt19937_64& generator) const;
+
+        /**
+         * In the unit of parseValue, microseconds for latencies
+         */
+        double sampleValue(std::mt19937_64& generator) const;
+
+        bool empty() const { return kind == Kind::NONE; }
+
+    private:
+        enum class Kind { NONE, FIXED, UNIFORM, EXPONENTIAL, LOGNORMAL };
+
+        Kind kind;
+        double first;
+        double second;
+    };
+
+    /**
+     * Returns bytes, takes k, m and g suffixes for KiB, MiB and GiB.
+     * Throws std::invalid_argument.
+     */
+    double parseSize(const std::string& text);
+
+    /**
+     * Adds configurable delays in front of another backend. Delays come
+     * from one seeded generator, so a single threaded run sees the same
+     * sequence every time.
+     */
+    class LatencyInjectingSyscallBackend: public SyscallBackend
+    {
+    public:
+        LatencyInjectingSyscallBackend(SyscallBackend& next, uint64_t seed);
+
+        void setLatency(SyscallClass syscallClass, const LatencyDistribution& distribution);
+
+        /**
+         * "<class>=<distribution>" where class is open, close, read,
+         * write, sync, rename, unlink or mkdir
+         */
+        void setLatency(const std::string& spec);
+
+        int openat(int dirFd, const char* path, int flags, mode_t mode) override { delay(SyscallClass::OPEN); return next.openat(dirFd, path, flags, mode); }
+
+        int close(int fd) override { delay(SyscallClass::CLOSE); return next.close(fd); }
+
+        ssize_t read(int fd, void* buffer, size_t size) override { delay(SyscallClass::READ); return next.read(fd, buffer, size); }
+
+        ssize_t write(int fd, const void* data, size_t size) override { delay(SyscallClass::WRITE); return next.write(fd, data, size); }
+
+        ssize_t pwrite(int fd, const void* data, size_t size, off_t offset) override { delay(SyscallClass::WRITE); return next.pwrite(fd, data, size, offset); }
+
+        off_t lseek(int fd, off_t offset, int whence) override { return next.lseek(fd, offset, whence); }
+
+        int ftruncate(int fd, off_t length) override { delay(SyscallClass::WRITE); return next.ftruncate(fd, length); }
+
+        int fstat(int fd, struct stat* st) override { return next.fstat(fd, st); }
+
+        int fsync(int fd) override { delay(SyscallClass::SYNC); return next.fsync(fd); }
+
+        int fdatasync(int fd) override { delay(SyscallClass::SYNC); return next.fdatasync(fd); }
+
+        int syncfs(int fd) override { delay(SyscallClass::SYNC); return next.syncfs(fd); }
+
+        int renameat(int oldDirFd, const char* oldPath, int newDirFd, const char* newPath, unsigned int flags) override
+        {
+            delay(SyscallClass::RENAME);
+            return next.renameat(oldDirFd, oldPath, newDirFd, newPath, flags);
+        }
+
+        int unlinkat(int dirFd, const char* path, int flags) override { delay(SyscallClass::UNLINK); return next.unlinkat(dirFd, path, flags); }
+
+        int mkdirat(int dirFd, const char* path, mode_t mode) override { delay(SyscallClass::MKDIR); return next.mkdirat(dirFd, path, mode); }
+
+        int symlinkat(const char* target, int dirFd, const char* path) override { delay(SyscallClass::MKDIR); return next.symlinkat(target, dirFd, path); }
+
+        int readDirectory(int dirFd, std::vector<std::pair<std::string, bool>>& entries) override { delay(SyscallClass::READ); return next.readDirectory(dirFd, entries); }
+
+    private:
+        void delay(SyscallClass syscallClass);
+
+        SyscallBackend& next;
+        std::mutex mutex;
+        std::mt19937_64 generator;
+        LatencyDistribution latencies[static_cast<size_t>(SyscallClass::COUNT)];
+    };
+
+    SyscallBackend*& currentSyscallBackend()
+    {
+        static PosixSyscallBackend posix;
+        static SyscallBackend* backend(&posix);
+        return backend;
+    }
+
+    SyscallBackend& syscalls()
+    {
+        return *currentSyscallBackend();
+    }
+
+    /**
+     * Must be called before any file is touched. The backend must
+     * outlive all file operations.
+     */
+    void setSyscallBackend(SyscallBackend& backend)
+    {
+        currentSyscallBackend() = &backend;
+    }
+
+    /**
+     * Bare file descriptor that is closed on destruction, for paths that
+     * must not allocate. Callers build errors themselves.
+     */
+    class ScopedFd
+    {
+    public:
+        explicit ScopedFd(int fd):
+            fd(fd)
+        {
+        }
+
+        ~ScopedFd()
+        {
+            if (fd >= 0)
+                /* Ignore errors */
+                syscalls().close(fd);
+        }
+
+        ScopedFd(const ScopedFd&) = delete;
+        ScopedFd& operator=(const ScopedFd&) = delete;
+
+        /**
+         * Like close(2)
+         */
+        int close()
+        {
+            const int copy(fd);
+            fd = -1;
+            return syscalls().close(copy);
+        }
+
+        /**
+         * Hands the descriptor over to the caller
+         */
+        int release()
+        {
+            const int copy(fd);
+            fd = -1;
+            return copy;
+        }
+
+        operator int() const noexcept { return fd; }
+
+    private:
+        int fd;
+    };
+
+    /**
+     * Like write(2) but writes everything. Returns false with errno set
+     * on failure.
+     */
+    bool writeFully(int fd, const void* data, size_t size)
+    {
+        size_t written(0);
+        while (written < size)
+        {
+            const ssize_t ret(syscalls().write(fd, static_cast<const char*>(data) + written, size - written));
+            if (ret < 0)
+                return false;
+            written += static_cast<size_t>(ret);
+        }
+        return true;
+    }
+
+    class BaseFd
+    {
+    public:
+        BaseFd(const std::string& directory,
+               const std::string& file,
+               int fd);
+
+        ~BaseFd();
+
+        /**
+         * The try-variants never throw, the others throw
+         * std::system_error on failure.
+         */
+        IoStatus trySync();
+
+        void sync();
+
+        IoStatus tryDataSync();
+
+        void dataSync();
+
+        /**
+         * Flush the whole filesystem containing fd
+         */
+        IoStatus trySyncFilesystem();
+
+        void syncFilesystem();
+
+        IoStatus tryClose();
+
+        void close();
+
+        operator int() const noexcept { return fd; }
+
+        BaseFd(const BaseFd&) = delete;
+        BaseFd(BaseFd&&) = delete;
+        BaseFd& operator=(const BaseFd&) = delete;
+        BaseFd& operator=(BaseFd&&) = delete;
+
+        const std::string directory;
+        const std::string file;
+        int fd;
+    };
+
+    class DirFd: public BaseFd
+    {
+    public:
+        DirFd(const std::string& directory);
+
+        /**
+         * Does not throw, status tells whether opening succeeded
+         */
+        DirFd(const std::string& directory, IoStatus& status);
+
+        IoStatus tryUnlink(const std::string& file);
+
+        void unlink(const std::string& file);
+
+        IoStatus tryRenameFile(const std::string& oldFile, const std::string& newFile);
+
+        void renameFile(const std::string& oldFile, const std::string& newFile);
+
+        /**
+         * Atomically exchange two files. Returns false if either one of
+         * them does not exist.
+         */
+        IoResult<bool> tryExchangeFiles(const std::string& file1, const std::string& file2);
+
+        bool exchangeFiles(const std::string& file1, const std::string& file2);
+
+        /**
+         * Create a subdirectory. Returns false if it already exists.
+         */
+        bool makeDirectory(const std::string& file);
+
+        void createSymlink(const std::string& target, const std::string& file);
+
+        /**
+         * (name, is directory) pairs of the directory contents
+         */
+        std::vector<std::pair<std::string, bool>> list();
+
+        /**
+         * Recursively remove a subdirectory and everything below it
+         */
+        void removeTree(const std::string& file);
+
+    private:
+        struct Checked {};
+
+        /**
+         * The throwing constructor, layered on the one taking status.
+         * status is a temporary of the delegating constructor that
+         * lives until this one returns.
+         */
+        DirFd(const std::string& directory, IoStatus&& status, Checked);
+
+        static const std::string NO_FILE;
+    };
+
+    class WriteFd: public BaseFd
+    {
+    public:
+        WriteFd(DirFd& dirFd, const std::string& file);
+
+        /**
+         * Does not throw, status tells whether opening succeeded
+         */
+        WriteFd(DirFd& dirFd, const std::string& file, IoStatus& status);
+
+        IoStatus tryWriteAll(const void* data, size_t size);
+
+        void writeAll(const void* data, size_t size);
+
+    private:
+        struct Checked {};
+
+        /**
+         * See DirFd
+         */
+        WriteFd(DirFd& dirFd, const std::string& file, IoStatus&& status, Checked);
+    };
+
+    enum class BarrierMethod
+    {
+        /**
+         * One syncfs() per filesystem touched during the epoch
+         */
+        SYNCFS,
+        /**
+         * Parallel fdatasync() of every dirty file followed by one
+         * fsync() per dirty directory
+         */
+        PER_FILE
+    };
+
+    /**
+     * Append-only array whose elements never move, so that they can be
+     * read without locking while others append
+     */
+    template <typename T>
+    class ChunkedArray
+    {
+    public:
+        ChunkedArray():
+            count(0)
+        {
+            for (auto& chunk: chunks)
+                chunk.store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~ChunkedArray()
+        {
+            for (auto& chunk: chunks)
+                delete[] chunk.load();
+        }
+
+        ChunkedArray(const ChunkedArray&) = delete;
+        ChunkedArray& operator=(const ChunkedArray&) = delete;
+
+        /**
+         * Returns the index of a new default constructed element
+         */
+        uint32_t append()
+        {
+            const uint32_t index(count++);
+            if (index >= CHUNK_SIZE * MAX_CHUNKS)
+                throw std::length_error("ChunkedArray is full");
+            auto& chunk(chunks[index >> CHUNK_BITS]);
+            if (!chunk.load(std::memory_order_acquire))
+            {
+                T* fresh(new T[CHUNK_SIZE]);
+                T* expected(nullptr);
+                if (!chunk.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel))
+                    delete[] fresh;
+            }
+            return index;
+        }
+
+        T& operator[](uint32_t index)
+        {
+            return chunks[index >> CHUNK_BITS].load(std::memory_order_acquire)[index & (CHUNK_SIZE - 1)];
+        }
+
+        uint32_t size() const
+        {
+            return std::min(count.load(), CHUNK_SIZE * MAX_CHUNKS);
+        }
+
+    private:
+        static const uint32_t CHUNK_BITS = 14;
+        static const uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+        static const uint32_t MAX_CHUNKS = 1u << 14;
+
+        std::atomic<uint32_t> count;
+        std::atomic<T*> chunks[MAX_CHUNKS];
+    };
+
+    /**
+     * Interns the paths of all CommittedFile objects as directory id and
+     * name, so that a file costs one entry no matter how many handles
+     * refer to it, and commits find everything they need by index.
+     * Entries live as long as the process.
+     */
+    class PathTable
+    {
+    public:
+        struct Entry
+        {
+            Entry():
+                name(nullptr),
+                directory(0),
+                started(0),
+                published(0),
+                dirtyIndex(0)
+            {
+            }
+
+            /**
+             * Owned by the table
+             */
+            const char* name;
+            uint32_t directory;
+
+            /**
+             * Sequence number of the most recently started commit.
+             * Sequence numbers wrap, compare them with isNewer().
+             */
+            std::atomic<uint32_t> started;
+
+            /**
+             * Sequence number of the version in place, guarded by
+             * publishMutex()
+             */
+            uint32_t published;
+
+            /**
+             * Position in the dirty files of the DurabilityEpoch plus
+             * one, 0 while clean. Guarded by the epoch.
+             */
+            uint32_t dirtyIndex;
+        };
+
+        static bool isNewer(uint32_t sequence, uint32_t than)
+        {
+            return static_cast<int32_t>(sequence - than) > 0;
+        }
+
+        static PathTable& instance();
+
+        PathId intern(const std::string& filePath);
+
+        Entry& entry(PathId id) { return entries[id]; }
+
+        const std::string& directory(PathId id) { return directories[entries[id].directory]; }
+
+        std::string path(PathId id);
+
+        /**
+         * Serializes renames of a path. Paths share a fixed set of
+         * mutexes, so there is no lock per path to pay for.
+         */
+        std::mutex& publishMutex(PathId id) { return publishMutexes[id % PUBLISH_LOCKS]; }
+
+        uint32_t size() const { return entries.size(); }
+
+        /**
+         * True for the first caller per directory of the path in this
+         * process, which is then the one to scan it for stale work-files
+         */
+        bool claimDirectoryScan(PathId id);
+
+    private:
+        PathTable():
+            nameBlockUsed(NAME_BLOCK_SIZE)
+        {
+        }
+
+        uint32_t internDirectory(const std::string& directory);
+
+        /**
+         * Copies name to storage that lives as long as the table.
+         * Names are packed into large blocks, so a name costs its
+         * length.
+         */
+        const char* storeName(const std::string& name);
+
+        static const size_t SHARDS = 64;
+        static const size_t PUBLISH_LOCKS = 1024;
+        static const size_t NAME_BLOCK_SIZE = 64 << 10;
+
+        struct Shard
+        {
+            std::mutex mutex;
+            /**
+             * Hash of directory id and name to the entries with that hash
+             */
+            std::unordered_multimap<size_t, PathId> ids;
+        };
+
+        ChunkedArray<Entry> entries;
+        ChunkedArray<std::string> directories;
+        std::mutex directoriesMutex;
+        std::unordered_map<std::string, uint32_t> directoryIds;
+        /**
+         * Guarded by directoriesMutex
+         */
+        std::unordered_set<uint32_t> scannedDirectories;
+        Shard shards[SHARDS];
+        std::mutex publishMutexes[PUBLISH_LOCKS];
+        std::mutex namesMutex;
+        std::vector<std::unique_ptr<char[]>> nameBlocks;
+        size_t nameBlockUsed;
+    };
+
+    /**
+     * Remembers directories known to exist durably, so that
+     * ensureDirectory() only touches the filesystem for new ones.
+     * Directories that already existed when first asked about are
+     * trusted to be durable.
+     */
+    class DurableDirectories
+    {
+    public:
+        static DurableDirectories& instance();
+
+        IoStatus ensure(const std::string& directory);
+
+    private:
+        DurableDirectories() {}
+
+        /**
+         * Also serializes creation, so that a directory is never
+         * reported durable before its creator has synced the parent
+         */
+        std::mutex mutex;
+        std::unordered_set<std::string> known;
+    };
+
+    /**
+     * Like mkdir -p, but each created directory is made durable by
+     * syncing its parent, once per new parent. Cheap for directories
+     * already ensured.
+     */
+    IoStatus tryEnsureDirectory(const std::string& directory)
+    {
+        return DurableDirectories::instance().ensure(directory);
+    }
+
+    void ensureDirectory(const std::string& directory)
+    {
+        tryEnsureDirectory(directory).check();
+    }
+
+    /**
+     * Keeps track of files committed with Durability::DEFERRED since the
+     * last barrier.
+     *
+     * The barrier flushes the inodes that were committed, through the
+     * work file descriptors handed over by markDirty(), and not whatever
+     * the names refer to by the time it runs. Commits beyond the
+     * descriptor budget, see FdReservation, sync their data themselves. It then flushes the
+     * directories with no deferred rename in flight, see PublishGuard, so
+     * that a rename of the next epoch cannot become durable before its
+     * data.
+     */
+    class DurabilityEpoch
+    {
+    public:
+        /**
+         * Held across the rename and markDirty() of a deferred commit
+         */
+        class PublishGuard
+        {
+        public:
+            explicit PublishGuard(bool deferred);
+            ~PublishGuard();
+
+            PublishGuard(const PublishGuard&) = delete;
+            PublishGuard& operator=(const PublishGuard&) = delete;
+
+        private:
+            const bool deferred;
+        };
+
+        /**
+         * One of the descriptors the epoch may hold, a quarter of
+         * RLIMIT_NOFILE. A deferred commit that gets none syncs its data
+         * itself before the rename and leaves only the directory to the
+         * barrier. Given back unless handed over with markDirty().
+         */
+        class FdReservation
+        {
+        public:
+            explicit FdReservation(bool deferred);
+            ~FdReservation();
+
+            FdReservation(const FdReservation&) = delete;
+            FdReservation& operator=(const FdReservation&) = delete;
+
+            bool held() const { return reserved; }
+
+        private:
+            friend class DurabilityEpoch;
+
+            bool reserved;
+        };
+
+        static DurabilityEpoch& instance();
+
+        /**
+         * Takes fd, the version just renamed to the path, if reservation
+         * is held. Otherwise its data must be synced already. With
+         * keepsPrevious the version it replaces lives on as <name>.prev
+         * and is flushed as well. Does not allocate once the list of
+         * dirty files has grown to the size of an epoch. Must be called
+         * with a PublishGuard and the publish mutex of the path held.
+         */
+        void markDirty(PathId id, FdReservation& reservation, ScopedFd& fd, bool keepsPrevious);
+
+        /**
+         * Make everything committed before the call durable. Returns the
+         * number of the epoch that was closed.
+         */
+        unsigned long barrier(BarrierMethod method);
+
+    private:
+        DurabilityEpoch();
+
+        struct DirtyFile
+        {
+            PathId id;
+            int fd;
+            int previousFd;
+        };
+
+        /**
+         * Empties the list and marks its paths clean
+         */
+        std::vector<DirtyFile> takeDirtyFiles();
+
+        /**
+         * Closes the descriptors and hands the capacity back to the next
+         * epoch
+         */
+        void releaseDirtyFiles(std::vector<DirtyFile>& files);
+
+        /**
+         * Closes a held descriptor, if any, and gives back its
+         * reservation
+         */
+        void closeHeld(int fd);
+
+        std::mutex mutex;
+        std::mutex barrierMutex;
+        pthread_rwlock_t publishLock;
+        std::atomic<long> heldFds;
+        long maxHeldFds;
+        /**
+         * Each path once, see PathTable::Entry::dirtyIndex
+         */
+        std::vector<DirtyFile> dirtyFiles;
+        unsigned long epoch;
+    };
+
+    unsigned long durabilityBarrier(BarrierMethod method = BarrierMethod::SYNCFS)
+    {
+        return DurabilityEpoch::instance().barrier(method);
+    }
+
+    std::string dirName(const std::string& filePath)
+    {
+        char buffer[filePath.size() + 1];
+        memcpy(buffer, filePath.c_str(), filePath.size() + 1);
+        return dirname(buffer);
+    }
+
+    std::string baseName(const std::string& filePath)
+    {
+        char buffer[filePath.size() + 1];
+        memcpy(buffer, filePath.c_str(), filePath.size() + 1);
+        return basename(buffer);
+    }
+
+    /**
+     * Work-files are <name>.work.<pid>.<sequence>, so that concurrent
+     * commits of the same path, also from other processes, never share
+     * one. Formats it without allocating, returns false if it does not
+     * fit.
+     */
+    bool formatWorkFileName(char* buffer, size_t size, const char* fileName, unsigned long sequence)
+    {
+        const int length(snprintf(buffer, size, "%s.work.%d.%lu", fileName, static_cast<int>(getpid()), sequence));
+        return (length > 0) && (static_cast<size_t>(length) < size);
+    }
+
+    /**
+     * Remove the legacy <name>.work of the path and, once per directory
+     * and process, the work-files of processes that no longer exist.
+     * Work-files of live processes, this one included, may belong to
+     * commits in flight and are kept.
+     */
+    void removeStaleWorkFiles(PathId id);
+
+    IoResult<std::string> tryReadFile(const std::string& filePath)
+    {
+        FSYNCTEST_PROBE1(read__begin, filePath.c_str());
+        auto fd(syscalls().openat(AT_FDCWD, filePath.c_str(), O_RDONLY | O_CLOEXEC, 0));
+        if (fd == -1)
+        {
+            FSYNCTEST_PROBE3(read__end, filePath.c_str(), 0UL, errno);
+            return IoStatus::fromErrno("open", "", filePath, "");
+        }
+
+        std::string contents;
+        char buffer[4096] = {};
+        ssize_t len = 0;
+        while ((len = syscalls().read(fd, &buffer, sizeof(buffer))) > 0)
+            contents.append(buffer, static_cast<size_t>(len));
+
+        const int savedErrno(errno);
+        syscalls().close(fd);
+        FSYNCTEST_PROBE3(read__end, filePath.c_str(), static_cast<unsigned long>(contents.size()), len < 0 ? savedErrno : 0);
+        if (len < 0)
+            return IoStatus::failure("read", "", filePath, "", savedErrno);
+
+        return contents;
+    }
+
+    std::string readFile(const std::string& filePath)
+    {
+        return tryReadFile(filePath).take();
+    }
+
+    uint32_t crc32(const void* data, size_t size, uint32_t crc = 0)
+    {
+        static const struct Table
+        {
+            Table()
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t c(i);
+                    for (int k = 0; k < 8; ++k)
+                        c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+                    entries[i] = c;
+                }
+            }
+            uint32_t entries[256];
+        } table;
+
+        const auto bytes(static_cast<const unsigned char*>(data));
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i)
+            crc = table.entries[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    /**
+     * Intent log making a group of file replacements atomic. A
+     * transaction is committed once its checksummed intent record is
+     * on disk. If we crash after that, the next TransactionLog opened on
+     * the same path finishes the renames.
+     */
+    class TransactionLog
+    {
+    public:
+        /**
+         * Recovers: finishes a committed transaction and then removes
+         * the work-files of transactions that never committed from
+         * directories, by default the directory of the log. Only one
+         * process may use the files of these directories with a log.
+         */
+        explicit TransactionLog(const std::string& logPath,
+                                const std::vector<std::string>& directories = std::vector<std::string>());
+
+        TransactionLog(const TransactionLog&) = delete;
+        TransactionLog& operator=(const TransactionLog&) = delete;
+
+        /**
+         * Work-files of all files must have been written and synced.
+         * Their directories are synced here, before the intent record.
+         */
+        void commit(uint64_t id, const std::vector<std::string>& filePaths);
+
+        static std::string workFileName(const std::string& fileName, uint64_t id);
+
+        /**
+         * Whether name is a work-file name as returned by workFileName()
+         */
+        static bool isWorkFileName(const std::string& name);
+
+    private:
+        void recover();
+
+        void removeOrphans(const std::vector<std::string>& directories);
+
+        void finish(uint64_t id, const std::vector<std::string>& filePaths);
+
+        std::mutex mutex;
+        DirFd logDirFd;
+        BaseFd logFd;
+    };
+
+    /**
+     * Group of file replacements that become visible together. Nothing
+     * is visible before commit(). Destroying an uncommitted transaction
+     * removes its work-files.
+     */
+    class FileTransaction
+    {
+    public:
+        explicit FileTransaction(TransactionLog& log);
+
+        ~FileTransaction();
+
+        FileTransaction(const FileTransaction&) = delete;
+        FileTransaction& operator=(const FileTransaction&) = delete;
+
+        void write(const std::string& filePath, const std::string& data);
+
+        void commit();
+
+    private:
+        TransactionLog& log;
+        const uint64_t id;
+        std::vector<std::string> filePaths;
+        bool committed;
+    };
+
+    /**
+     * Publishes bundles of files as numbered version directories under
+     * <root>/versions and atomically switches the <root>/current symlink
+     * to the newest one, so that readers going through current see
+     * either the whole old bundle or the whole new one. Old versions
+     * are removed by a background thread.
+     */
+    class SnapshotPublisher
+    {
+    public:
+        /**
+         * keepVersions is the number of newest versions, including the
+         * current one, that are not garbage collected.
+         */
+        explicit SnapshotPublisher(const std::string& rootDirectory,
+                                   unsigned keepVersions = 2,
+                                   BarrierMethod method = BarrierMethod::SYNCFS);
+
+        ~SnapshotPublisher();
+
+        SnapshotPublisher(const SnapshotPublisher&) = delete;
+        SnapshotPublisher& operator=(const SnapshotPublisher&) = delete;
+
+        /**
+         * Files are given as (relative path, data) pairs. Returns the
+         * published version number.
+         */
+        unsigned long publish(const std::vector<std::pair<std::string, std::string>>& files);
+
+    private:
+        void writeVersion(const std::string& versionDirectory,
+                          const std::vector<std::pair<std::string, std::string>>& files);
+
+        void collectGarbage();
+
+        const std::string rootDirectory;
+        const std::string versionsDirectory;
+        const unsigned keepVersions;
+        const BarrierMethod method;
+        std::mutex publishMutex;
+        unsigned long lastVersion;
+
+        std::mutex gcMutex;
+        std::condition_variable gcCondition;
+        bool gcPending;
+        bool stopping;
+        std::thread gcThread;
+
+        static const std::string CURRENT;
+        static const std::string VERSIONS;
+    };
+
+    /**
+     * Log-linear latency histogram in nanoseconds. Values are kept with
+     * 5 significant bits (about 3% relative error), which is plenty for
+     * percentiles and keeps histograms small enough to keep one per
+     * thread and merge them at the end.
+     */
+    class LatencyHistogram
+    {
+    public:
+        LatencyHistogram():
+            counts(BUCKETS, 0),
+            total(0),
+            sum(0),
+            maxValue(0)
+        {
+        }
+
+        void record(uint64_t nanoseconds)
+        {
+            ++counts[bucketOf(nanoseconds)];
+            ++total;
+            sum += nanoseconds;
+            maxValue = std::max(maxValue, nanoseconds);
+        }
+
+        void record(std::chrono::steady_clock::duration elapsed)
+        {
+            record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        }
+
+        void merge(const LatencyHistogram& other)
+        {
+            for (size_t i = 0; i < BUCKETS; ++i)
+                counts[i] += other.counts[i];
+            total += other.total;
+            sum += other.sum;
+            maxValue = std::max(maxValue, other.maxValue);
+        }
+
+        uint64_t count() const { return total; }
+
+        uint64_t max() const { return maxValue; }
+
+        uint64_t sumOfValues() const { return sum; }
+
+        uint64_t bucketCount(size_t bucket) const { return counts[bucket]; }
+
+        /**
+         * Rebuilds a histogram from its bucket counts, e.g. read from a
+         * histogram log. counts must have BUCKETS entries.
+         */
+        static LatencyHistogram fromCounts(std::vector<uint64_t> counts, uint64_t sum, uint64_t maxValue)
+        {
+            LatencyHistogram histogram;
+            histogram.counts = std::move(counts);
+            for (const auto count: histogram.counts)
+                histogram.total += count;
+            histogram.sum = sum;
+            histogram.maxValue = maxValue;
+            return histogram;
+        }
+
+        double mean() const { return total ? static_cast<double>(sum) / static_cast<double>(total) : 0.0; }
+
+        /**
+         * q in [0, 1]. Returns the upper edge of the bucket holding the
+         * value, capped to the largest recorded value.
+         */
+        uint64_t percentile(double q) const;
+
+        static const size_t BUCKETS = 64 + 58 * 32;
+
+        static size_t bucketOf(uint64_t value)
+        {
+            if (value < 64)
+                return static_cast<size_t>(value);
+            const int shift(63 - __builtin_clzll(value) - 5);
+            return 64 + static_cast<size_t>(shift - 1) * 32 + static_cast<size_t>((value >> shift) - 32);
+        }
+
+        static uint64_t bucketUpperEdge(size_t bucket)
+        {
+            if (bucket < 64)
+                return bucket;
+            const unsigned shift(static_cast<unsigned>((bucket - 64) / 32 + 1));
+            const uint64_t top((bucket - 64) % 32 + 32);
+            return ((top + 1) << shift) - 1;
+        }
+
+    private:
+        std::vector<uint64_t> counts;
+        uint64_t total;
+        uint64_t sum;
+        uint64_t maxValue;
+    };
+
+    void printLatencySummary(std::ostream& os, const std::string& name, const LatencyHistogram& histogram)
+    {
+        const auto us = [](double nanoseconds) { return nanoseconds / 1000.0; };
+        os << name << ": count=" << histogram.count();
+        if (histogram.count())
+            os << " mean=" << us(histogram.mean()) << "us"
+               << " p50=" << us(histogram.percentile(0.5)) << "us"
+               << " p90=" << us(histogram.percentile(0.9)) << "us"
+               << " p99=" << us(histogram.percentile(0.99)) << "us"
+               << " p99.9=" << us(histogram.percentile(0.999)) << "us"
+               << " max=" << us(histogram.max()) << "us";
+        os << std::endl;
+    }
+
+    /**
+     * Tells readers whether a rename or directory fsync was in progress
+     * somewhere while they were reading.
+     */
+    class CommitActivityMonitor: public CommitObserver
+    {
+    public:
+        CommitActivityMonitor():
+            active(0),
+            entered(0),
+            elided(0)
+        {
+        }
+
+        void commitElided(PathId) override
+        {
+            ++elided;
+        }
+
+        unsigned long elidedCommits() const
+        {
+            return elided.load();
+        }
+
+        void phaseBegin(PathId, CommitPhase phase) override
+        {
+            if ((phase == CommitPhase::RENAME) || (phase == CommitPhase::DIRECTORY_SYNC))
+            {
+                ++entered;
+                ++active;
+            }
+        }
+
+        void phaseEnd(PathId, CommitPhase phase) override
+        {
+            if ((phase == CommitPhase::RENAME) || (phase == CommitPhase::DIRECTORY_SYNC))
+                --active;
+        }
+
+        struct Sample
+        {
+            long active;
+            unsigned long entered;
+        };
+
+        Sample sample() const
+        {
+            return Sample{ active.load(), entered.load() };
+        }
+
+        bool overlapped(const Sample& before) const
+        {
+            return (before.active > 0) || (entered.load() != before.entered);
+        }
+
+    private:
+        std::atomic<long> active;
+        std::atomic<unsigned long> entered;
+        std::atomic<unsigned long> elided;
+    };
+
+    /**
+     * Commit traces are a header followed by records:
+     *
+     *   u32 magic, u32 version
+     *   DEFINE_PATH: u8 op, u32 path id, u32 length, path bytes
+     *   COMMIT/READ: u8 op, u64 nanoseconds since start, u32 path id, u32 size
+     *
+     * Paths are defined before their first use. All integers are in
+     * host byte order.
+     */
+    enum class TraceOp: uint8_t
+    {
+        DEFINE_PATH = 1,
+        COMMIT = 2,
+        READ = 3
+    };
+
+    struct TraceRecord
+    {
+        TraceOp op;
+        uint64_t timestamp;
+        uint32_t pathId;
+        uint32_t size;
+    };
+
+    struct Trace
+    {
+        std::vector<std::string> paths;
+        std::vector<TraceRecord> records;
+    };
+
+    /**
+     * Throws std::runtime_error on malformed traces
+     */
+    Trace loadTrace(const std::string& traceFile);
+
+    /**
+     * Records commits and reads going through CommittedFile into a trace
+     * file. Records are buffered and written out in large chunks.
+     */
+    class TraceRecorder: public CommitObserver
+    {
+    public:
+        explicit TraceRecorder(const std::string& traceFile);
+
+        ~TraceRecorder();
+
+        void commitBegin(PathId id, size_t size) override
+        {
+            record(TraceOp::COMMIT, id, size);
+        }
+
+        void readBegin(PathId id) override
+        {
+            record(TraceOp::READ, id, 0);
+        }
+
+    private:
+        void record(TraceOp op, PathId id, size_t size);
+
+        template <typename T>
+        void append(T value)
+        {
+            buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void flush();
+
+        std::mutex mutex;
+        std::ofstream output;
+        const std::chrono::steady_clock::time_point start;
+        /**
+         * PathTable id to the id of the path in the trace
+         */
+        std::unordered_map<PathId, uint32_t> pathIds;
+        std::string buffer;
+    };
+
+    /**
+     * Per-interval throughput, latency and concurrency of commits, to
+     * make periodic stalls visible. Commit begin and end times are
+     * appended to a per-thread buffer and only bucketed at the end.
+     */
+    class TimelineRecorder: public CommitObserver
+    {
+    public:
+        explicit TimelineRecorder(std::chrono::nanoseconds interval);
+
+        void commitBegin(PathId id, size_t size) override;
+
+        void commitEnd(PathId id, int error) override;
+
+        /**
+         * CSV, one line per interval from the first event to the last
+         */
+        void print(std::ostream& os);
+
+    private:
+        struct Event
+        {
+            uint64_t time;
+            /**
+             * Commit latency, BEGIN for begin events
+             */
+            uint64_t latency;
+        };
+
+        static const uint64_t BEGIN = UINT64_MAX;
+
+        std::vector<Event>& threadEvents();
+
+        uint64_t now() const
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        const std::chrono::nanoseconds interval;
+        const std::chrono::steady_clock::time_point start;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<std::vector<Event>>> events;
+    };
+
+    struct HistogramInterval
+    {
+        /**
+         * Seconds since the start of the log
+         */
+        double start;
+        double length;
+        LatencyHistogram histogram;
+    };
+
+    /**
+     * Commit latencies per interval, in the spirit of an HdrHistogram
+     * interval log: a text file with one line per interval of
+     *
+     *   start_s,length_s,max_ms,<base64 histogram>
+     *
+     * The histogram holds the LatencyHistogram bucket count, sum and
+     * max followed by the bucket counts, all as zigzag LEB128 varints,
+     * with runs of empty buckets written as their negated length. HDR
+     * also deflates that payload, this format does not. Logs of several
+     * runs can be merged by merging their intervals.
+     */
+    struct HistogramLog
+    {
+        /**
+         * Seconds since the epoch
+         */
+        double startTime;
+        std::vector<HistogramInterval> intervals;
+
+        LatencyHistogram merged() const
+        {
+            LatencyHistogram all;
+            for (const auto& interval: intervals)
+                all.merge(interval.histogram);
+            return all;
+        }
+    };
+
+    std::string encodeHistogram(const LatencyHistogram& histogram);
+
+    /**
+     * Throws std::runtime_error on malformed input
+     */
+    LatencyHistogram decodeHistogram(const std::string& encoded);
+
+    void writeHistogramLog(std::ostream& os, const HistogramLog& log);
+
+    /**
+     * Throws std::runtime_error on malformed logs
+     */
+    HistogramLog loadHistogramLog(const std::string& logFile);
+
+    /**
+     * Compares p50 and p99 of current with baseline and prints 95%
+     * bootstrap confidence intervals of their relative change. Returns
+     * true if the lower bound of a change exceeds threshold, e.g. 0.05,
+     * so the run is slower than the baseline by more than that with
+     * good confidence.
+     */
+    bool compareWithBaseline(std::ostream& os, const LatencyHistogram& baseline, const LatencyHistogram& current,
+                             double threshold, uint64_t seed);
+
+    /**
+     * Collects successful commit latencies into one histogram per
+     * interval and thread, merged by log()
+     */
+    class HistogramLogRecorder: public CommitObserver
+    {
+    public:
+        explicit HistogramLogRecorder(std::chrono::nanoseconds interval);
+
+        void commitBegin(PathId id, size_t size) override;
+
+        void commitEnd(PathId id, int error) override;
+
+        /**
+         * Call when no commits are in flight anymore
+         */
+        HistogramLog log();
+
+    private:
+        struct ThreadState
+        {
+            std::chrono::steady_clock::time_point commitStart;
+            std::vector<LatencyHistogram> intervals;
+        };
+
+        ThreadState& threadState();
+
+        const std::chrono::nanoseconds interval;
+        const std::chrono::steady_clock::time_point start;
+        const std::chrono::system_clock::time_point startTime;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadState>> states;
+    };
+
+    /**
+     * One job of a job file, see loadJobFile()
+     */
+    struct JobSpec
+    {
+        std::string name;
+        std::vector<std::string> directories;
+        /**
+         * Per directory, named <name>.<n>
+         */
+        long files;
+        /**
+         * Payload bytes
+         */
+        LatencyDistribution size;
+        /**
+         * Commits per second of all threads together, 0 for unlimited
+         */
+        double rate;
+        long threads;
+        Durability durability;
+        /**
+         * The job ends after duration or count commits, whichever comes
+         * first. 0 means no limit, but one of them is set.
+         */
+        std::chrono::microseconds duration;
+        long count;
+    };
+
+    /**
+     * Reads an INI style job file:
+     *
+     *   # comment
+     *   [global]
+     *   durability = grouped
+     *   duration = 10s
+     *
+     *   [configs]
+     *   directory = /data/a, /data/b
+     *   files = 100
+     *   size = lognormal:4k:0.5
+     *   rate = 200
+     *   threads = 4
+     *
+     * Each other section is a job. Keys of [global] are defaults for the
+     * jobs that follow it, defaults not given there come from
+     * defaults. Sizes are a number or a distribution like those of
+     * --inject-latency, with k, m and g suffixes. Throws
+     * std::runtime_error on malformed files.
+     */
+    std::vector<JobSpec> loadJobFile(const std::string& jobFile, const JobSpec& defaults);
+
+    struct PathStats
+    {
+        std::string path;
+        uint64_t commits;
+        uint64_t bytes;
+        uint64_t totalLatency;
+        uint64_t maxLatency;
+        /**
+         * Commits that found a newer version in place and skipped their
+         * rename
+         */
+        uint64_t elided;
+        uint64_t failures;
+    };
+
+    /**
+     * Commit counters per path, to find the files that cause most of the
+     * sync load. Counters are indexed by PathId and updated without
+     * locking, only the first commit of a path beyond the known ids grows
+     * the array. Latencies are in nanoseconds.
+     */
+    class PathStatsRegistry: public CommitObserver
+    {
+    public:
+        PathStatsRegistry():
+            known(0)
+        {
+        }
+
+        void commitBegin(PathId id, size_t size) override;
+
+        void commitElided(PathId id) override;
+
+        void commitEnd(PathId id, int error) override;
+
+        /**
+         * Snapshot of all paths, in no particular order
+         */
+        std::vector<PathStats> dump() const;
+
+        /**
+         * The n paths with the highest cumulative commit latency
+         */
+        std::vector<PathStats> top(size_t n) const;
+
+        static void printTop(std::ostream& os, const std::vector<PathStats>& stats);
+
+        /**
+         * CSV with a header line
+         */
+        static void printCsv(std::ostream& os, const std::vector<PathStats>& stats);
+
+    private:
+        struct Counters
+        {
+            Counters():
+                commits(0),
+                bytes(0),
+                totalLatency(0),
+                maxLatency(0),
+                elided(0),
+                failures(0)
+            {
+            }
+
+            std::atomic<uint64_t> commits;
+            std::atomic<uint64_t> bytes;
+            std::atomic<uint64_t> totalLatency;
+            std::atomic<uint64_t> maxLatency;
+            std::atomic<uint64_t> elided;
+            std::atomic<uint64_t> failures;
+        };
+
+        /**
+         * The commit in progress on this thread
+         */
+        struct Current
+        {
+            const PathStatsRegistry* owner;
+            Counters* counters;
+            size_t size;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        static Current& current();
+
+        Counters& counters(PathId id);
+
+        /**
+         * Guards growing paths
+         */
+        std::mutex mutex;
+        mutable ChunkedArray<Counters> paths;
+        /**
+         * Ids below are allocated in paths
+         */
+        std::atomic<uint32_t> known;
+    };
+
+    /**
+     * System state sampled right after a slow commit
+     */
+    struct PressureSnapshot
+    {
+        PressureSnapshot():
+            ioSome(-1),
+            ioFull(-1),
+            memorySome(-1),
+            memoryFull(-1),
+            dirtyKb(-1),
+            writebackKb(-1),
+            inflightReads(-1),
+            inflightWrites(-1)
+        {
+        }
+
+        /**
+         * avg10 values of /proc/pressure/{io,memory}, -1 if unavailable
+         */
+        double ioSome;
+        double ioFull;
+        double memorySome;
+        double memoryFull;
+        long dirtyKb;
+        long writebackKb;
+        /**
+         * From /sys/dev/block/<major>:<minor>/inflight of the device
+         * holding the file
+         */
+        long inflightReads;
+        long inflightWrites;
+
+        static PressureSnapshot take(const std::string& filePath);
+    };
+
+    /**
+     * Keeps the last commits that took longer than a threshold together
+     * with their phase breakdown and system pressure. The ring buffer is
+     * dumped on exit and whenever SIGUSR1 arrives, also by an idle or hung
+     * process: the signal handler only writes to a pipe and a thread of
+     * the recorder does the dump.
+     */
+    class SlowCommitRecorder: public CommitObserver
+    {
+    public:
+        SlowCommitRecorder(std::chrono::nanoseconds threshold, size_t capacity, std::ostream& os);
+
+        ~SlowCommitRecorder();
+
+        void commitBegin(PathId id, size_t size) override;
+
+        void phaseBegin(PathId id, CommitPhase phase) override;
+
+        void phaseEnd(PathId id, CommitPhase phase) override;
+
+        void commitEnd(PathId id, int error) override;
+
+        void dump();
+
+    private:
+        static const size_t PHASES = static_cast<size_t>(CommitPhase::DIRECTORY_SYNC) + 1;
+
+        struct Entry
+        {
+            std::string filePath;
+            size_t size;
+            int error;
+            std::chrono::system_clock::time_point when;
+            std::chrono::nanoseconds total;
+            std::chrono::nanoseconds phases[PHASES];
+            PressureSnapshot pressure;
+        };
+
+        struct ThreadState
+        {
+            std::chrono::steady_clock::time_point commitStart;
+            std::chrono::steady_clock::time_point phaseStart;
+            size_t size;
+            std::chrono::nanoseconds phases[PHASES];
+        };
+
+        static ThreadState& threadState();
+
+        static void onSignal(int);
+
+        /**
+         * Dumps for every 'd' on the pipe until it reads 's'
+         */
+        void serviceSignals();
+
+        const std::chrono::nanoseconds threshold;
+        const size_t capacity;
+        std::ostream& os;
+        std::mutex mutex;
+        std::vector<Entry> entries;
+        size_t next;
+        unsigned long dropped;
+        int pipeFds[2];
+        std::thread signalThread;
+
+        /**
+         * Write end of the pipe of the installed recorder, for the
+         * signal handler
+         */
+        static std::atomic<int> signalFd;
+    };
+
+    /**
+     * Records every commit and commit phase as Chrome trace events, to
+     * see on a timeline (chrome://tracing, ui.perfetto.dev) how commits
+     * of many threads overlap and where they serialize. Events go to a
+     * ring buffer per thread, so a long run keeps its last events, and
+     * are only converted to JSON by write(). The buffers are appended to
+     * without locking, so write() must not run before the threads that
+     * commit have been joined.
+     */
+    class ChromeTraceRecorder: public CommitObserver
+    {
+    public:
+        ChromeTraceRecorder();
+
+        void commitBegin(PathId id, size_t size) override;
+
+        void phaseBegin(PathId id, CommitPhase phase) override;
+
+        void phaseEnd(PathId id, CommitPhase phase) override;
+
+        void commitElided(PathId id) override;
+
+        void commitEnd(PathId id, int error) override;
+
+        /**
+         * Only call once every thread that committed while the recorder
+         * was installed has been joined, which also makes its events
+         * visible here
+         */
+        void write(std::ostream& os);
+
+    private:
+        /**
+         * Events kept per thread
+         */
+        static const size_t CAPACITY = 1 << 16;
+
+        enum class EventKind: uint8_t
+        {
+            COMMIT_BEGIN,
+            COMMIT_END,
+            PHASE_BEGIN,
+            PHASE_END,
+            ELIDED
+        };
+
+        struct Event
+        {
+            uint64_t time;
+            /**
+             * Size for COMMIT_BEGIN, error for COMMIT_END
+             */
+            int64_t value;
+            PathId path;
+            EventKind kind;
+            CommitPhase phase;
+        };
+
+        struct ThreadBuffer
+        {
+            long tid;
+            std::vector<Event> events;
+            size_t next;
+            unsigned long dropped;
+        };
+
+        ThreadBuffer& threadBuffer();
+
+        void record(EventKind kind, PathId id, CommitPhase phase, int64_t value);
+
+        uint64_t now() const
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        static void writeString(std::ostream& os, const std::string& value);
+
+        /**
+         * Tells the buffer of a thread apart from that of an earlier
+         * recorder, which may have lived at the same address
+         */
+        const uint64_t generation;
+        const std::chrono::steady_clock::time_point start;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+        static std::atomic<uint64_t> generations;
+    };
+
+    const uint32_t TRACE_MAGIC(0x52545346); // "FSTR"
+    const uint32_t TRACE_VERSION(1);
+
+    /**
+     * Io policies of BasicCommittedFile
+     */
+    struct DirectIo
+    {
+        static int openat(int dirFd, const char* path, int flags, mode_t mode) { return ::openat(dirFd, path, flags, mode); }
+        static int close(int fd) { return ::close(fd); }
+        static ssize_t read(int fd, void* buffer, size_t size) { return ::read(fd, buffer, size); }
+        static ssize_t write(int fd, const void* data, size_t size) { return ::write(fd, data, size); }
+        static int fsync(int fd) { return ::fsync(fd); }
+        static int fdatasync(int fd) { return ::fdatasync(fd); }
+        static int rename(int dirFd, const char* oldFile, const char* newFile) { return ::renameat(dirFd, oldFile, dirFd, newFile); }
+        static int unlinkat(int dirFd, const char* file, int flags) { return ::unlinkat(dirFd, file, flags); }
+    };
+
+    struct BackendIo
+    {
+        static int openat(int dirFd, const char* path, int flags, mode_t mode) { return syscalls().openat(dirFd, path, flags, mode); }
+        static int close(int fd) { return syscalls().close(fd); }
+        static ssize_t read(int fd, void* buffer, size_t size) { return syscalls().read(fd, buffer, size); }
+        static ssize_t write(int fd, const void* data, size_t size) { return syscalls().write(fd, data, size); }
+        static int fsync(int fd) { return syscalls().fsync(fd); }
+        static int fdatasync(int fd) { return syscalls().fdatasync(fd); }
+        static int rename(int dirFd, const char* oldFile, const char* newFile) { return syscalls().renameat(dirFd, oldFile, dirFd, newFile, 0); }
+        static int unlinkat(int dirFd, const char* file, int flags) { return syscalls().unlinkat(dirFd, file, flags); }
+    };
+
+    /**
+     * Durability policies of BasicCommittedFile
+     */
+    struct FsyncDurability
+    {
+        static const char* name() { return "fsync"; }
+        template <typename Io>
+        static int syncData(int fd) { return Io::fsync(fd); }
+    };
+
+    struct FdatasyncDurability
+    {
+        static const char* name() { return "fdatasync"; }
+        template <typename Io>
+        static int syncData(int fd) { return Io::fdatasync(fd); }
+    };
+
+    /**
+     * Format policies of BasicCommittedFile. A format prepends a fixed
+     * size header to the payload and validates it on read.
+     */
+    struct RawFormat
+    {
+        static const size_t HEADER_SIZE = 0;
+        static void encodeHeader(const std::string& /*data*/, char* /*header*/) {}
+        /**
+         * Returns false if contents are not valid
+         */
+        static bool decode(std::string& /*contents*/) { return true; }
+    };
+
+    /**
+     * Header is magic, payload length and CRC32 of the payload, so torn
+     * or foreign files are detected on read.
+     */
+    struct ChecksummedFormat
+    {
+        static const size_t HEADER_SIZE = 16;
+        static const uint32_t MAGIC = 0x46435346; // "FSCF"
+
+        static void encodeHeader(const std::string& data, char* header)
+        {
+            const uint32_t magic(MAGIC);
+            const uint64_t length(data.size());
+            const uint32_t checksum(crc32(data.data(), data.size()));
+            memcpy(header, &magic, 4);
+            memcpy(header + 4, &length, 8);
+            memcpy(header + 12, &checksum, 4);
+        }
+
+        static bool decode(std::string& contents)
+        {
+            if (contents.size() < HEADER_SIZE)
+                return false;
+            uint32_t magic;
+            uint64_t length;
+            uint32_t checksum;
+            memcpy(&magic, contents.data(), 4);
+            memcpy(&length, contents.data() + 4, 8);
+            memcpy(&checksum, contents.data() + 12, 4);
+            if ((magic != MAGIC) ||
+                (length != contents.size() - HEADER_SIZE) ||
+                (checksum != crc32(contents.data() + HEADER_SIZE, contents.size() - HEADER_SIZE)))
+                return false;
+            contents.erase(0, HEADER_SIZE);
+            return true;
+        }
+    };
+
+    /**
+     * The CommittedFile protocol with every strategy fixed at compile
+     * time, so that nothing on the commit path is an indirect call. Only
+     * covers the plain replace commit; KEEP_PREVIOUS, deferred and
+     * grouped durability and CommitObservers need CommittedFile.
+     */
+    template <typename DurabilityPolicy, typename FormatPolicy, typename IoBackend>
+    class BasicCommittedFile
+    {
+    public:
+        explicit BasicCommittedFile(const std::string& filePath):
+            filePath(filePath),
+            directory(dirName(filePath)),
+            fileName(baseName(filePath)),
+            id(PathTable::instance().intern(filePath))
+        {
+            removeStaleWorkFiles(id);
+        }
+
+        void write(const std::string& data)
+        {
+            /**
+             * Work-files, sequence numbers and the publish step are
+             * those of CommittedFile, so that both can commit the same
+             * path and the version that started last still wins
+             */
+            auto& table(PathTable::instance());
+            auto& entry(table.entry(id));
+            const uint32_t sequence(++entry.started);
+            char workFileName[NAME_MAX + 64];
+            if (!formatWorkFileName(workFileName, sizeof(workFileName), fileName.c_str(), sequence))
+            {
+                errno = ENAMETOOLONG;
+                fail("open", fileName, "");
+            }
+            Fd dirFd(openDirectory());
+            Fd workFileFd(IoBackend::openat(dirFd.fd,
+                                            workFileName,
+                                            O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                                            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+            if (workFileFd.fd == -1)
+                fail("open", workFileName, "");
+            if (FormatPolicy::HEADER_SIZE)
+            {
+                char header[FormatPolicy::HEADER_SIZE ? FormatPolicy::HEADER_SIZE : 1];
+                FormatPolicy::encodeHeader(data, header);
+                writeAll(workFileFd.fd, workFileName, header, FormatPolicy::HEADER_SIZE);
+            }
+            writeAll(workFileFd.fd, workFileName, data.data(), data.size());
+            if (DurabilityPolicy::template syncData<IoBackend>(workFileFd.fd) == -1)
+                fail(DurabilityPolicy::name(), workFileName, "");
+            workFileFd.close(*this, workFileName);
+            {
+                std::lock_guard<std::mutex> lock(table.publishMutex(id));
+                if (PathTable::isNewer(entry.published, sequence))
+                {
+                    if ((IoBackend::unlinkat(dirFd.fd, workFileName, 0) == -1) && (errno != ENOENT))
+                        fail("unlink", workFileName, "");
+                }
+                else
+                {
+                    if (IoBackend::rename(dirFd.fd, workFileName, fileName.c_str()) == -1)
+                        fail("rename", workFileName, fileName);
+                    entry.published = sequence;
+                }
+            }
+            if (IoBackend::fsync(dirFd.fd) == -1)
+                fail("fsync", "", "");
+            dirFd.close(*this);
+        }
+
+        std::string read() const
+        {
+            const int fd(IoBackend::openat(AT_FDCWD, filePath.c_str(), O_RDONLY | O_CLOEXEC, 0));
+            if (fd == -1)
+                throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", filePath, errno).c_str());
+            std::string contents;
+            char buffer[4096];
+            ssize_t len;
+            while ((len = IoBackend::read(fd, buffer, sizeof(buffer))) > 0)
+                contents.append(buffer, static_cast<size_t>(len));
+            const int savedErrno(errno);
+            IoBackend::close(fd);
+            if (len < 0)
+                throw std::system_error(savedErrno, std::system_category(), buildCommittedFileReadError("read", filePath, savedErrno).c_str());
+            if (!FormatPolicy::decode(contents))
+                throw std::system_error(EBADMSG, std::system_category(), buildCommittedFileReadError("decode", filePath, EBADMSG).c_str());
+            return contents;
+        }
+
+        const std::string& getPath() const { return filePath; }
+
+    private:
+        struct Fd
+        {
+            explicit Fd(int fd): fd(fd) {}
+
+            ~Fd()
+            {
+                if (fd >= 0)
+                    /* Ignore errors */
+                    IoBackend::close(fd);
+            }
+
+            void close(const BasicCommittedFile& file, const std::string& name = std::string())
+            {
+                const int copy(fd);
+                fd = -1;
+                if (IoBackend::close(copy) == -1)
+                    file.fail("close", name, "");
+            }
+
+            Fd(const Fd&) = delete;
+            Fd& operator=(const Fd&) = delete;
+
+            int fd;
+        };
+
+        int openDirectory() const
+        {
+            const int fd(IoBackend::openat(AT_FDCWD, directory.c_str(), O_RDONLY | O_CLOEXEC, 0));
+            if (fd == -1)
+                fail("open", "", "");
+            return fd;
+        }
+
+        void writeAll(int fd, const char* workFileName, const void* data, size_t size) const
+        {
+            size_t written(0);
+            while (written < size)
+            {
+                const ssize_t ret(IoBackend::write(fd, static_cast<const char*>(data) + written, size - written));
+                if (ret < 0)
+                    fail("write", workFileName, "");
+                written += static_cast<size_t>(ret);
+            }
+        }
+
+        [[noreturn]] void fail(const char* func, const std::string& file1, const std::string& file2) const
+        {
+            throw std::system_error(errno, std::system_category(), buildCommittedFileError(func, directory, file1, file2, errno).c_str());
+        }
+
+        const std::string filePath;
+        const std::string directory;
+        const std::string fileName;
+        const PathId id;
+    };
+
+    /**
+     * Type-erased holder for code that picks the file type at run time
+     */
+    class AnyCommittedFile
+    {
+    public:
+        template <typename File>
+        static AnyCommittedFile create(const std::string& filePath)
+        {
+            return AnyCommittedFile(std::unique_ptr<Concept>(new Model<File>(filePath)));
+        }
+
+        std::string read() const { return file->read(); }
+
+        void write(const std::string& data) { file->write(data); }
+
+        std::string getPath() const { return file->getPath(); }
+
+    private:
+        struct Concept
+        {
+            virtual ~Concept() {}
+            virtual std::string read() const = 0;
+            virtual void write(const std::string& data) = 0;
+            virtual std::string getPath() const = 0;
+        };
+
+        template <typename File>
+        struct Model: public Concept
+        {
+            explicit Model(const std::string& filePath): file(filePath) {}
+            std::string read() const override { return file.read(); }
+            void write(const std::string& data) override { file.write(data); }
+            std::string getPath() const override { return file.getPath(); }
+            File file;
+        };
+
+        explicit AnyCommittedFile(std::unique_ptr<Concept> file): file(std::move(file)) {}
+
+        std::unique_ptr<Concept> file;
+    };
+
+    struct GroupCommitConfig
+    {
+        GroupCommitConfig():
+            p99Target(std::chrono::milliseconds(10)),
+            maxWindow(std::chrono::milliseconds(5)),
+            maxBatch(256)
+        {
+        }
+
+        /**
+         * Target for the time a commit spends waiting for its directory
+         * fsync, including the batching window
+         */
+        std::chrono::nanoseconds p99Target;
+        std::chrono::nanoseconds maxWindow;
+        /**
+         * The window is cut short once this many commits are waiting
+         */
+        unsigned long maxBatch;
+        /**
+         * Name of a POSIX shared memory object through which directory
+         * fsyncs are also shared with other processes. Empty to share
+         * them within this process only.
+         */
+        std::string sharedSegment;
+    };
+
+    struct GroupCommitStats
+    {
+        unsigned long directories;
+        unsigned long batches;
+        unsigned long commits;
+        /**
+         * Latest controller state, taken from the busiest directory
+         */
+        double windowUs;
+        double syncCostUs;
+        double arrivalsPerSecond;
+        double gain;
+        double ioPressure;
+        double observedP99Us;
+        /**
+         * Directory fsyncs of the shared segment this process issued and
+         * those it waited for instead
+         */
+        unsigned long sharedLed;
+        unsigned long sharedJoined;
+    };
+
+    /**
+     * Cross-process counterpart of the GroupCommitter. Processes map the
+     * same shared memory object, which holds one slot per directory,
+     * identified by device and inode. Whoever finds no fsync of a
+     * directory in flight becomes its leader and issues one covering
+     * every rename requested before it started. The others sleep on a
+     * futex until the leader publishes completion.
+     *
+     * The slot table is guarded by a robust process-shared mutex, so a
+     * process dying while holding it does not wedge the others. A leader
+     * that dies during its fsync is detected by its waiters, which then
+     * take over.
+     */
+    class SharedDirectorySync
+    {
+    public:
+        explicit SharedDirectorySync(const std::string& name);
+
+        ~SharedDirectorySync();
+
+        SharedDirectorySync(const SharedDirectorySync&) = delete;
+        SharedDirectorySync& operator=(const SharedDirectorySync&) = delete;
+
+        IoStatus syncDirectory(const std::string& directory);
+
+        unsigned long led() const { return leaderSyncs.load(); }
+
+        unsigned long joined() const { return joinedSyncs.load(); }
+
+    private:
+        static const uint32_t MAGIC = 0x46534753; // "FSGS"
+        static const uint32_t VERSION = 2;
+        static const size_t SLOTS = 64;
+        static const size_t FAILURES = 4;
+
+        struct Failure
+        {
+            uint64_t first;
+            uint64_t last;
+            int32_t error;
+        };
+
+        struct Slot
+        {
+            /**
+             * Both 0 for a free slot
+             */
+            uint64_t device;
+            uint64_t inode;
+            uint64_t requested;
+            uint64_t done;
+            /**
+             * pid of the process issuing the fsync or 0
+             */
+            int32_t leader;
+            uint32_t nextFailure;
+            Failure failures[FAILURES];
+            /**
+             * Highest ticket of the failures overwritten in the ring and
+             * the error of the last of them. A waiter whose ticket is not
+             * above it cannot tell whether its fsync failed.
+             */
+            uint64_t droppedThrough;
+            int32_t droppedError;
+            /**
+             * Futex word, bumped whenever done advances or a leader gives
+             * up
+             */
+            std::atomic<uint32_t> generation;
+        };
+
+        struct Segment
+        {
+            std::atomic<uint32_t> magic;
+            uint32_t version;
+            pthread_mutex_t mutex;
+            Slot slots[SLOTS];
+        };
+
+        void lock();
+
+        void unlock();
+
+        Slot* slot(uint64_t device, uint64_t inode);
+
+        std::string name;
+        Segment* segment;
+        std::atomic<unsigned long> leaderSyncs;
+        std::atomic<unsigned long> joinedSyncs;
+    };
+
+    /**
+     * Shares directory fsyncs between commits to the same directory.
+     * The first committer to arrive becomes the leader, waits for a
+     * short window to collect more renames and issues one fsync that
+     * covers everybody who arrived before it started.
+     *
+     * The window is derived from the estimated fsync cost and arrival
+     * rate: waiting pays off only when other commits are expected during
+     * an fsync, so at low load it shrinks to zero. A gain on top of that
+     * shrinks whenever a window collects nobody or the observed p99 wait
+     * exceeds the target, and grows while windows pay off and the p99
+     * has headroom. Full io pressure (PSI) widens the window as every
+     * fsync saved matters more on a congested device.
+     */
+    class GroupCommitter
+    {
+    public:
+        static GroupCommitter& instance();
+
+        /**
+         * Must be called before any grouped commits
+         */
+        void configure(const GroupCommitConfig& config);
+
+        /**
+         * Returns once a fsync of directory that started after the call
+         * has completed
+         */
+        IoStatus trySyncDirectory(const std::string& directory);
+
+        GroupCommitStats stats();
+
+    private:
+        /**
+         * Kept until every committer it covers has collected it
+         */
+        struct Failure
+        {
+            unsigned long first;
+            unsigned long last;
+            int error;
+            unsigned long uncollected;
+        };
+
+        struct DirectoryGroup
+        {
+            DirectoryGroup();
+
+            std::chrono::nanoseconds window(const GroupCommitConfig& config, double ioPressure) const;
+
+            void adapt(const GroupCommitConfig& config);
+
+            static constexpr double MIN_GAIN = 0.05;
+            static constexpr double MAX_GAIN = 4.0;
+
+            std::mutex mutex;
+            std::condition_variable condition;
+            unsigned long requested;
+            unsigned long done;
+            bool syncing;
+            std::vector<Failure> failures;
+
+            std::chrono::steady_clock::time_point lastArrival;
+            double interarrivalNs;
+            double syncCostNs;
+            double gain;
+            std::chrono::nanoseconds lastWindow;
+            LatencyHistogram recentWaits;
+            uint64_t lastP99;
+            unsigned long batches;
+        };
+
+        GroupCommitter();
+
+        DirectoryGroup& group(const std::string& directory);
+
+        double ioPressure();
+
+        IoStatus syncNow(const std::string& directory);
+
+        GroupCommitConfig config;
+        std::unique_ptr<SharedDirectorySync> shared;
+        std::mutex mutex;
+        std::map<std::string, std::unique_ptr<DirectoryGroup>> groups;
+        std::chrono::steady_clock::time_point pressureSampled;
+        double pressure;
+    };
+
+    void printGroupCommitStats(std::ostream& os, const GroupCommitStats& stats)
+    {
+        os << "Group commit: directories=" << stats.directories
+           << " batches=" << stats.batches
+           << " commits=" << stats.commits
+           << " commits/batch=" << (stats.batches ? static_cast<double>(stats.commits) / static_cast<double>(stats.batches) : 0.0)
+           << " window=" << stats.windowUs << "us"
+           << " fsync=" << stats.syncCostUs << "us"
+           << " arrivals=" << stats.arrivalsPerSecond << "/s"
+           << " gain=" << stats.gain
+           << " io_full=" << stats.ioPressure
+           << " wait_p99=" << stats.observedP99Us << "us";
+        if (stats.sharedLed || stats.sharedJoined)
+            os << " shared_led=" << stats.sharedLed
+               << " shared_joined=" << stats.sharedJoined;
+        os << std::endl;
+    }
+
+    /**
+     * Wire format between CommitClient and CommitDaemon on a Unix stream
+     * socket. Payloads do not go through the socket: the client places
+     * path and data in a ring buffer in a memfd it passed along with
+     * HELLO, and COMMIT only tells where they are.
+     */
+    enum class CommitRequestOp: uint32_t
+    {
+        /**
+         * Carries the ring memfd as SCM_RIGHTS, offset is the ring size
+         */
+        HELLO = 1,
+        COMMIT = 2
+    };
+
+    struct CommitRequest
+    {
+        CommitRequestOp op;
+        uint32_t pathLength;
+        uint64_t id;
+        uint64_t offset;
+        uint64_t dataLength;
+    };
+
+    struct CommitAck
+    {
+        uint64_t id;
+        /**
+         * errno of a failed commit or 0 once the commit is durable
+         */
+        int32_t error;
+        uint32_t reserved;
+    };
+
+    /**
+     * Serves commits of local processes under a root directory. Every
+     * client connection has a thread that picks requests out of its
+     * ring, and a shared pool of workers commits them with the regular
+     * CommittedFile protocol, so that grouped directory fsyncs are shared
+     * between all clients.
+     */
+    class CommitDaemon
+    {
+    public:
+        CommitDaemon(const std::string& socketPath,
+                     const std::string& rootDirectory,
+                     const CommitOptions& options,
+                     unsigned workers);
+
+        ~CommitDaemon();
+
+        CommitDaemon(const CommitDaemon&) = delete;
+        CommitDaemon& operator=(const CommitDaemon&) = delete;
+
+        /**
+         * Serves until stop() is called or, unless 0, maxCommits have
+         * been acknowledged
+         */
+        void run(unsigned long maxCommits);
+
+        /**
+         * Async-signal-safe
+         */
+        void stop();
+
+        unsigned long acknowledged() const { return commits.load(); }
+
+        unsigned long connections() const { return accepted.load(); }
+
+    private:
+        struct Client
+        {
+            Client(int fd);
+
+            ~Client();
+
+            int fd;
+            const char* ring;
+            size_t ringSize;
+            std::mutex sendMutex;
+        };
+
+        struct Job
+        {
+            std::shared_ptr<Client> client;
+            uint64_t id;
+            std::string path;
+            std::string data;
+        };
+
+        struct ClientThread
+        {
+            std::weak_ptr<Client> client;
+            std::thread thread;
+        };
+
+        void serve(std::shared_ptr<Client> client);
+
+        /**
+         * Joins the threads of closed connections
+         */
+        void reapClients();
+
+        void work();
+
+        void acknowledge(Client& client, uint64_t id, int error);
+
+        /**
+         * CommittedFile of a path relative to the root directory. The
+         * handles are cached, but creating one may scan its directory, so
+         * that happens outside filesMutex.
+         */
+        CommittedFile file(const std::string& path);
+
+        const std::string socketPath;
+        const std::string rootDirectory;
+        const CommitOptions options;
+        int listenFd;
+        std::atomic<bool> stopping;
+        std::atomic<unsigned long> commits;
+        std::atomic<unsigned long> accepted;
+
+        std::mutex clientsMutex;
+        std::vector<ClientThread> clientThreads;
+        std::vector<std::thread::id> finishedThreads;
+
+        std::mutex queueMutex;
+        std::condition_variable queueCondition;
+        std::deque<Job> queue;
+        bool closed;
+        std::vector<std::thread> workers;
+
+        /**
+         * Bound of files, clients can name any number of paths
+         */
+        static const size_t MAX_FILES = 4096;
+
+        std::mutex filesMutex;
+        std::unordered_map<std::string, CommittedFile> files;
+    };
+
+    /**
+     * Connection to a CommitDaemon. commit() may be called from any
+     * number of threads, their requests are pipelined on the one
+     * connection.
+     */
+    class CommitClient
+    {
+    public:
+        explicit CommitClient(const std::string& socketPath, size_t ringSize = DEFAULT_RING_SIZE);
+
+        ~CommitClient();
+
+        CommitClient(const CommitClient&) = delete;
+        CommitClient& operator=(const CommitClient&) = delete;
+
+        /**
+         * Commits data to path, relative to the root directory of the
+         * daemon. Returns once the daemon reports it durable.
+         */
+        IoStatus commit(const std::string& path, const std::string& data);
+
+        static const size_t DEFAULT_RING_SIZE = 4 << 20;
+
+    private:
+        struct Pending
+        {
+            uint64_t id;
+            uint64_t offset;
+            uint64_t length;
+            bool done;
+            bool collected;
+            int error;
+        };
+
+        /**
+         * Reserves length bytes of the ring, waiting for acks to free
+         * space if needed
+         */
+        uint64_t allocate(std::unique_lock<std::mutex>& lock, uint64_t length);
+
+        void receive();
+
+        int fd;
+        size_t ringSize;
+        char* ring;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<Pending> pending;
+        uint64_t nextId;
+        int connectionError;
+
+        std::mutex sendMutex;
+        std::thread receiver;
+    };
+
+    std::string getRandomData()
+    {
+        auto now(std::chrono::system_clock::now());
+        auto nowTimeT(std::chrono::system_clock::to_time_t(now));
+        return std::ctime(&nowTimeT);
+
+    }
+}
+
+void usage()
+{
+    std::cout
+        << "Usage: fsynctest [options] <filename> <count>" << std::endl
+        << "       fsynctest [options] --job-file <file>" << std::endl
+        << "Options:" << std::endl
+        << "  --writers <n>       Commit from n threads, each <count> times to its own file" << std::endl
+        << "  --readers <n>       Read the committed files from n threads meanwhile" << std::endl
+        << "  --read-ratio <r>    Limit readers to r reads per commit (default 0, unlimited)" << std::endl
+        << "  --shared-file       Let all writers commit to <filename> concurrently" << std::endl
+        << "  --compare           Run <count> commits each as plain write, write and fsync in place," << std::endl
+        << "                      write, fsync and rename, and the full protocol, interleaved," << std::endl
+        << "                      and report the cost of every step" << std::endl
+        << "  --verify <how>      Read back every commit and compare it with what was written, through" << std::endl
+        << "                      the page cache (cached) or bypassing it with O_DIRECT (direct)." << std::endl
+        << "                      Exits with 1 on any mismatch." << std::endl
+        << "  --interference-rate <MB/s>" << std::endl
+        << "                      Run <count> commits alone and then again while a background" << std::endl
+        << "                      writer dirties page cache at this rate (0 for unlimited)" << std::endl
+        << "  --interference-file-size <MB>" << std::endl
+        << "                      Size the background writer file wraps around at (default 1024)" << std::endl
+        << "  --interference-dir <dir>" << std::endl
+        << "                      Directory for the background writer file (default: that of <filename>)" << std::endl
+        << "  --backend <name>    posix (default) or memory, an in-process filesystem" << std::endl
+        << "  --inject-latency <class>=<distribution>" << std::endl
+        << "                      Delay every open, close, read, write, sync, rename, unlink or mkdir" << std::endl
+        << "                      by fixed:<t>, uniform:<min>:<max>, exp:<mean> or lognormal:<median>:<sigma>." << std::endl
+        << "                      Times default to us, ms and s suffixes are accepted. Can be repeated." << std::endl
+        << "  --seed <n>          Seed for injected latencies (default 1)" << std::endl
+        << "  --record <file>     Record a trace of all commits and reads of the run" << std::endl
+        << "  --replay <file>     Replay a trace into directory <filename>, at most <count> records" << std::endl
+        << "  --replay-speed <x>  Replay x times faster than recorded, 0 for as fast as possible (default 1)" << std::endl
+        << "  --replay-threads <n>" << std::endl
+        << "                      Replay from n threads, paths are spread over threads (default 1)" << std::endl
+        << "  --timeline <ms>     Print commit throughput, latency and concurrency per interval" << std::endl
+        << "  --top-paths <n>     Print the n paths with the highest total commit time" << std::endl
+        << "  --path-stats <file> Write commit counters of every path as CSV" << std::endl
+        << "  --histogram-log <file>" << std::endl
+        << "                      Write commit latency histograms per interval to an interval log" << std::endl
+        << "  --histogram-interval <ms>" << std::endl
+        << "                      Interval of --histogram-log (default 1000)" << std::endl
+        << "  --baseline <file>   Compare p50 and p99 with a histogram log of an earlier run and" << std::endl
+        << "                      exit with 1 if they got significantly slower" << std::endl
+        << "  --regression-threshold <percent>" << std::endl
+        << "                      Slowdown tolerated by --baseline (default 5)" << std::endl
+        << "  --chrome-trace <file>" << std::endl
+        << "                      Write commits and their phases per thread as Chrome trace JSON" << std::endl
+        << "  --slow-commit-threshold <ms>" << std::endl
+        << "                      Capture phase timings and system pressure of slower commits," << std::endl
+        << "                      dumped at exit and on SIGUSR1" << std::endl
+        << "  --slow-commit-capacity <n>" << std::endl
+        << "                      Number of slow commits kept (default 100)" << std::endl
+        << "  --durability <mode> immediate (default), deferred (one barrier at the end) or" << std::endl
+        << "                      grouped (directory fsyncs shared between concurrent commits)" << std::endl
+        << "  --create-directories" << std::endl
+        << "                      Create missing directories of <filename> durably" << std::endl
+        << "  --keep-previous     Keep the version each commit replaces as <filename>.prev" << std::endl
+        << "  --rollback          After the commits swap <filename> and <filename>.prev back and" << std::endl
+        << "                      check that the previous version is in place, implies --keep-previous" << std::endl
+        << "  --txn <n>           Commit <count> transactions, each replacing <filename>.0 to <filename>.<n-1>" << std::endl
+        << "                      atomically through the intent log <filename>.txnlog. Recovers and" << std::endl
+        << "                      checks the files of an interrupted run first. Exits with 1 if the" << std::endl
+        << "                      files of a transaction are not all alike." << std::endl
+        << "  --publish <n>       Publish <count> snapshots of n files below directory <filename> and" << std::endl
+        << "                      read each back through <filename>/current. Exits with 1 on any mismatch." << std::endl
+        << "  --barrier <method>  How deferred commits and snapshots are made durable: syncfs (default)," << std::endl
+        << "                      one syncfs per filesystem, or per-file, fdatasync of every file" << std::endl
+        << "  --group-shm <name>  Also share grouped directory fsyncs with other processes through" << std::endl
+        << "                      this POSIX shared memory object, e.g. /fsynctest" << std::endl
+        << "  --group-p99-target <ms>" << std::endl
+        << "                      p99 target of the grouped directory fsync wait (default 10)" << std::endl
+        << "  --daemon <socket>   Serve <count> commits of local clients below directory <filename>" << std::endl
+        << "                      on this Unix socket, with grouped durability" << std::endl
+        << "  --client <socket>   Commit <count> times to <filename>, relative to the root directory" << std::endl
+        << "                      of the daemon on this socket, from --writers threads" << std::endl
+        << "  --job-file <file>   Run the jobs of an INI style job file concurrently and report per job." << std::endl
+        << "                      Sections are jobs, [global] sets defaults for the jobs below it." << std::endl
+        << "                      Keys: directory (comma separated), files (per directory), size" << std::endl
+        << "                      (bytes or a distribution as for --inject-latency, k/m/g suffixes)," << std::endl
+        << "                      rate (commits/s, 0 unlimited), threads, durability, duration, count." << std::endl
+        << "                      --durability is the default durability." << std::endl
+        << "  --bench-dispatch    Compare per-commit cost of CommittedFile, BasicCommittedFile and" << std::endl
+        << "                      AnyCommittedFile, best run on tmpfs" << std::endl;
+    exit(0);
+}
+
+enum class VerifyMode
+{
+    NONE,
+    CACHED,
+    DIRECT
+};
+
+struct TestOptions
+{
+    TestOptions():
+        writers(0),
+        readers(0),
+        readRatio(0.0),
+        sharedFile(false),
+        compare(false),
+        verify(VerifyMode::NONE),
+        interferenceRate(-1.0),
+        interferenceFileSize(1024),
+        backend("posix"),
+        seed(1),
+        replaySpeed(1.0),
+        replayThreads(1),
+        timelineInterval(0),
+        topPaths(0),
+        histogramInterval(1000),
+        regressionThreshold(5),
+        benchDispatch(false),
+        slowCommitThreshold(-1),
+        slowCommitCapacity(100),
+        rollback(false),
+        transactionFiles(0),
+        snapshotFiles(0),
+        barrierMethod(BarrierMethod::SYNCFS)
+    {
+    }
+
+    long writers;
+    long readers;
+    double readRatio;
+    bool sharedFile;
+    bool compare;
+    VerifyMode verify;
+    double interferenceRate;
+    long interferenceFileSize;
+    std::string interferenceDir;
+    std::string backend;
+    std::vector<std::string> injectedLatencies;
+    uint64_t seed;
+    std::string recordFile;
+    std::string replayFile;
+    double replaySpeed;
+    long replayThreads;
+    double timelineInterval;
+    long topPaths;
+    std::string pathStatsFile;
+    std::string chromeTraceFile;
+    std::string jobFile;
+    std::string histogramLogFile;
+    double histogramInterval;
+    std::string baselineFile;
+    double regressionThreshold;
+    bool benchDispatch;
+    std::string daemonSocket;
+    std::string clientSocket;
+    double slowCommitThreshold;
+    long slowCommitCapacity;
+    bool rollback;
+    long transactionFiles;
+    long snapshotFiles;
+    BarrierMethod barrierMethod;
+    CommitOptions commitOptions;
+    GroupCommitConfig groupCommitConfig;
+};
+
+/**
+ * Reads back committed files and compares them with what was written.
+ * May be used from any number of threads.
+ */
+class CommitVerifier
+{
+public:
+    CommitVerifier(VerifyMode mode):
+        mode(mode),
+        verified(0),
+        mismatched(0)
+    {
+    }
+
+    /**
+     * Returns false if the contents differ or cannot be read
+     */
+    bool verify(const CommittedFile& file, const std::string& data);
+
+    unsigned long mismatches() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return mismatched;
+    }
+
+    void print(std::ostream& os) const;
+
+private:
+    /**
+     * O_DIRECT needs buffer, offset and length aligned to the logical
+     * block size, which is at most this on common devices
+     */
+    static const size_t ALIGNMENT = 4096;
+
+    static IoResult<std::string> readDirect(const std::string& filePath);
+
+    const VerifyMode mode;
+    mutable std::mutex mutex;
+    LatencyHistogram latency;
+    unsigned long verified;
+    unsigned long mismatched;
+    std::string firstMismatch;
+};
+
+IoResult<std::string> CommitVerifier::readDirect(const std::string& filePath)
+{
+    ScopedFd fd(syscalls().openat(AT_FDCWD, filePath.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC, 0));
+    if (fd == -1)
+        return IoStatus::fromErrno("open", "", filePath, "");
+    struct stat st;
+    if (syscalls().fstat(fd, &st) == -1)
+        return IoStatus::fromErrno("fstat", "", filePath, "");
+    const size_t size(static_cast<size_t>(st.st_size));
+    const size_t capacity(std::max(ALIGNMENT, (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+    void* memory(nullptr);
+    if (posix_memalign(&memory, ALIGNMENT, capacity) != 0)
+        throw std::bad_alloc();
+    std::unique_ptr<char, decltype(&free)> buffer(static_cast<char*>(memory), &free);
+    size_t done(0);
+    while (done < size)
+    {
+        const ssize_t ret(syscalls().read(fd, buffer.get() + done, capacity - done));
+        if (ret < 0)
+            return IoStatus::fromErrno("read", "", filePath, "");
+        if (ret == 0)
+            break;
+        done += static_cast<size_t>(ret);
+    }
+    return std::string(buffer.get(), std::min(done, size));
+}
+
+bool CommitVerifier::verify(const CommittedFile& file, const std::string& data)
+{
+    const auto start(std::chrono::steady_clock::now());
+    auto contents(mode == VerifyMode::DIRECT ? readDirect(file.getPath()) : file.tryRead());
+    const auto elapsed(std::chrono::steady_clock::now() - start);
+    const bool matches(contents.ok() && (contents.value() == data));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    latency.record(elapsed);
+    ++verified;
+    if (matches)
+        return true;
+    if (mismatched++ > 0)
+        return false;
+    if (!contents.ok())
+    {
+        firstMismatch = contents.getStatus().error().message();
+        return false;
+    }
+    const auto& actual(contents.value());
+    const auto difference(std::mismatch(data.begin(),
+                                        data.begin() + static_cast<std::ptrdiff_t>(std::min(data.size(), actual.size())),
+                                        actual.begin()));
+    std::ostringstream os;
+    os << '"' << file.getPath() << "\": wrote " << data.size() << " bytes, read " << actual.size()
+       << " bytes, first difference at offset " << (difference.first - data.begin());
+    firstMismatch = os.str();
+    return false;
+}
+
+void CommitVerifier::print(std::ostream& os) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    printLatencySummary(os, mode == VerifyMode::DIRECT ? "Read-back (direct)" : "Read-back (cached)", latency);
+    os << "Verified " << verified << " commits, " << mismatched << " mismatches" << std::endl;
+    if (mismatched)
+        os << "First mismatch: " << firstMismatch << std::endl;
+}
+
+void writeFile(const std::string& filename, const CommitOptions& commitOptions, CommitVerifier* verifier)
+{
+    const auto data(getRandomData());
+    std::unique_ptr<CommittedFile> cf;
+    {
+        ElapsedTimeMonitor dummy("Write file");
+        cf.reset(new CommittedFile(filename, commitOptions));
+        cf->write(data);
+    }
+    if (verifier)
+        verifier->verify(*cf, data);
+}
+
+/**
+ * Restores the version before the last commit of filename. Returns false
+ * if it is not the one that was <filename>.prev.
+ */
+bool rollbackFile(const std::string& filename, const CommitOptions& commitOptions)
+{
+    try
+    {
+        CommittedFile cf(filename, commitOptions);
+        const auto previous(readFile(filename + ".prev"));
+        const auto current(cf.read());
+        {
+            ElapsedTimeMonitor dummy("Rollback");
+            cf.rollback();
+        }
+        if ((cf.read() != previous) || (readFile(filename + ".prev") != current))
+        {
+            std::cout << "Rollback of " << filename << " did not restore the previous version" << std::endl;
+            return false;
+        }
+    }
+    catch (const std::system_error& e)
+    {
+        std::cout << "Rollback of " << filename << " failed: " << e.what() << std::endl;
+        return false;
+    }
+    std::cout << "Rolled back " << filename << std::endl;
+    return true;
+}
+
+void runMixedWorkload(const std::string& filename, long count, const TestOptions& options, CommitVerifier* verifier)
+{
+    const long writers(std::max(1L, options.writers));
+    std::vector<std::string> filenames;
+    for (long i = 0; i < writers; ++i)
+        filenames.push_back(((writers == 1) || options.sharedFile) ? filename : filename + '.' + std::to_string(i));
+
+    /**
+     * Constructing a CommittedFile removes stale work-files, so every
+     * object is created before the first writer starts.
+     */
+    std::vector<std::unique_ptr<CommittedFile>> files;
+    for (const auto& name: filenames)
+    {
+        files.emplace_back(new CommittedFile(name, options.commitOptions));
+        files.back()->write(getRandomData());
+    }
+
+    CommitActivityMonitor monitor;
+    addCommitObserver(monitor);
+
+    std::mutex mutex;
+    std::condition_variable progress;
+    std::atomic<unsigned long> commits(0);
+    std::atomic<unsigned long> reads(0);
+    std::atomic<long> runningWriters(writers);
+    std::vector<LatencyHistogram> writeLatencies(static_cast<size_t>(writers));
+    std::vector<LatencyHistogram> quietReadLatencies(static_cast<size_t>(options.readers));
+    std::vector<LatencyHistogram> overlappedReadLatencies(static_cast<size_t>(options.readers));
+
+    std::vector<std::thread> threads;
+    for (long i = 0; i < writers; ++i)
+        threads.emplace_back([&, i]()
+        {
+            auto& cf(*files[static_cast<size_t>(i)]);
+            const auto data(getRandomData());
+            for (long j = 0; j < count; ++j)
+            {
+                const auto start(std::chrono::steady_clock::now());
+                cf.write(data);
+                writeLatencies[static_cast<size_t>(i)].record(std::chrono::steady_clock::now() - start);
+                if (verifier)
+                    verifier->verify(cf, data);
+                {
+                    /**
+                     * Under the mutex or a reader that just evaluated its
+                     * predicate misses the wakeup
+                     */
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++commits;
+                }
+                progress.notify_all();
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --runningWriters;
+            }
+            progress.notify_all();
+        });
+    for (long i = 0; i < options.readers; ++i)
+        threads.emplace_back([&, i]()
+        {
+            size_t next(static_cast<size_t>(i));
+            while (runningWriters.load() > 0)
+            {
+                if (options.readRatio > 0)
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    progress.wait(lock, [&]()
+                    {
+                        return (runningWriters.load() == 0) ||
+                            (static_cast<double>(reads.load()) < options.readRatio * static_cast<double>(commits.load() + 1));
+                    });
+                    if (runningWriters.load() == 0)
+                        break;
+                }
+                const auto& file(*files[next++ % files.size()]);
+                const auto before(monitor.sample());
+                const auto start(std::chrono::steady_clock::now());
+                file.read();
+                const auto elapsed(std::chrono::steady_clock::now() - start);
+                if (monitor.overlapped(before))
+                    overlappedReadLatencies[static_cast<size_t>(i)].record(elapsed);
+                else
+                    quietReadLatencies[static_cast<size_t>(i)].record(elapsed);
+                ++reads;
+            }
+        });
+    for (auto& thread: threads)
+        thread.join();
+    removeCommitObserver(monitor);
+
+    LatencyHistogram writeLatency;
+    for (const auto& histogram: writeLatencies)
+        writeLatency.merge(histogram);
+    LatencyHistogram quietReadLatency;
+    for (const auto& histogram: quietReadLatencies)
+        quietReadLatency.merge(histogram);
+    LatencyHistogram overlappedReadLatency;
+    for (const auto& histogram: overlappedReadLatencies)
+        overlappedReadLatency.merge(histogram);
+    LatencyHistogram readLatency(quietReadLatency);
+    readLatency.merge(overlappedReadLatency);
+
+    printLatencySummary(std::cout, "Commit", writeLatency);
+    printLatencySummary(std::cout, "Read", readLatency);
+    printLatencySummary(std::cout, "Read during rename/dirsync", overlappedReadLatency);
+    printLatencySummary(std::cout, "Read otherwise", quietReadLatency);
+    if (options.sharedFile)
+        std::cout << "Elided renames: " << monitor.elidedCommits() << " of " << commits.load() << std::endl;
+}
+
+/**
+ * Dirties page cache in the background without ever syncing, so that
+ * commits have to compete with writeback and journal commits.
+ */
+class BulkWriter
+{
+public:
+    BulkWriter(const std::string& directory, double megabytesPerSecond, long fileSizeMegabytes):
+        directory(directory),
+        bytesPerSecond(megabytesPerSecond * 1024 * 1024),
+        fileSize(static_cast<uint64_t>(std::max(1L, fileSizeMegabytes)) * 1024 * 1024),
+        stopping(false),
+        written(0),
+        thread(&BulkWriter::run, this)
+    {
+    }
+
+    ~BulkWriter()
+    {
+        stopping = true;
+        thread.join();
+    }
+
+    uint64_t bytesWritten() const { return written.load(); }
+
+private:
+    void run()
+    {
+        static const std::string FILE_NAME("fsynctest-bulk");
+        try
+        {
+            DirFd dirFd(directory);
+            WriteFd fileFd(dirFd, FILE_NAME);
+            const std::string chunk(1024 * 1024, 'x');
+            const auto start(std::chrono::steady_clock::now());
+            uint64_t offset(0);
+            while (!stopping)
+            {
+                /**
+                 * Rewrite the same range instead of unlinking, dropping
+                 * dirty pages of a deleted file would relieve pressure.
+                 */
+                if (offset >= fileSize)
+                {
+                    if (syscalls().lseek(fileFd, 0, SEEK_SET) == -1)
+                        throw std::system_error(errno, std::system_category(), buildCommittedFileError("lseek", directory, FILE_NAME, "", errno).c_str());
+                    offset = 0;
+                }
+                fileFd.writeAll(chunk.data(), chunk.size());
+                offset += chunk.size();
+                written += chunk.size();
+                if (bytesPerSecond > 0)
+                {
+                    const auto due(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                       std::chrono::duration<double>(static_cast<double>(written.load()) / bytesPerSecond)));
+                    while (!stopping && (std::chrono::steady_clock::now() < due))
+                        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                                                        due - std::chrono::steady_clock::now(),
+                                                        std::chrono::milliseconds(10)));
+                }
+            }
+            fileFd.close();
+            dirFd.unlink(FILE_NAME);
+            dirFd.close();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Background writer failed: " << e.what() << std::endl;
+        }
+    }
+
+    const std::string directory;
+    const double bytesPerSecond;
+    const uint64_t fileSize;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> written;
+    std::thread thread;
+};
+
+LatencyHistogram runCommitLoop(CommittedFile& cf, long count, CommitVerifier* verifier)
+{
+    LatencyHistogram latency;
+    const auto data(getRandomData());
+    for (long i = 0; i < count; ++i)
+    {
+        const auto start(std::chrono::steady_clock::now());
+        cf.write(data);
+        latency.record(std::chrono::steady_clock::now() - start);
+        if (verifier)
+            verifier->verify(cf, data);
+    }
+    return latency;
+}
+
+void runInterferenceTest(const std::string& filename, long count, const TestOptions& options, CommitVerifier* verifier)
+{
+    CommittedFile cf(filename, options.commitOptions);
+    const auto quietLatency(runCommitLoop(cf, count, verifier));
+
+    LatencyHistogram noisyLatency;
+    uint64_t bulkBytes;
+    std::chrono::steady_clock::duration bulkTime;
+    {
+        const auto start(std::chrono::steady_clock::now());
+        BulkWriter bulkWriter(options.interferenceDir.empty() ? dirName(filename) : options.interferenceDir,
+                              options.interferenceRate,
+                              options.interferenceFileSize);
+        /**
+         * Give the background writer a moment to build up dirty pages
+         */
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        noisyLatency = runCommitLoop(cf, count, verifier);
+        bulkBytes = bulkWriter.bytesWritten();
+        bulkTime = std::chrono::steady_clock::now() - start;
+    }
+
+    printLatencySummary(std::cout, "Commit without interference", quietLatency);
+    printLatencySummary(std::cout, "Commit with interference", noisyLatency);
+    std::cout << "Background writer dirtied " << bulkBytes / (1024 * 1024) << "MB at "
+              << static_cast<double>(bulkBytes) / (1024 * 1024) / std::chrono::duration<double>(bulkTime).count()
+              << "MB/s" << std::endl;
+}
+
+/**
+ * Checks that the files of the transactions hold the same contents and
+ * that no work-file is left. Files that do not exist yet are skipped.
+ */
+bool checkTransactionFiles(const std::vector<std::string>& filePaths, const std::string& what)
+{
+    std::string contents;
+    size_t found(0);
+    for (const auto& filePath: filePaths)
+    {
+        auto result(tryReadFile(filePath));
+        if (!result.ok() && (result.getStatus().error().error == ENOENT))
+            continue;
+        const auto data(result.take());
+        if (found++ == 0)
+            contents = data;
+        else if (data != contents)
+        {
+            std::cout << what << " check failed: " << filePath << " differs from the other files" << std::endl;
+            return false;
+        }
+    }
+    DirFd dirFd(dirName(filePaths.front()));
+    for (const auto& entry: dirFd.list())
+        if (!entry.second && TransactionLog::isWorkFileName(entry.first))
+        {
+            std::cout << what << " check failed: work-file " << entry.first << " left over" << std::endl;
+            return false;
+        }
+    dirFd.close();
+    std::cout << what << " check: " << found << " of " << filePaths.size() << " files alike" << std::endl;
+    return true;
+}
+
+/**
+ * Commits count transactions, each replacing <filename>.0 to
+ * <filename>.<n-1> with the same contents. Opening the log recovers an
+ * interrupted run, the check after that makes sure that a transaction
+ * is either in place in all files or in none.
+ */
+bool runTransactions(const std::string& filename, long count, const TestOptions& options)
+{
+    std::vector<std::string> filePaths;
+    for (long i = 0; i < options.transactionFiles; ++i)
+        filePaths.push_back(filename + '.' + std::to_string(i));
+
+    std::unique_ptr<TransactionLog> log;
+    {
+        ElapsedTimeMonitor dummy("Transaction recovery");
+        log.reset(new TransactionLog(filename + ".txnlog", std::vector<std::string>(1, dirName(filename))));
+    }
+    if (!checkTransactionFiles(filePaths, "Recovery"))
+        return false;
+
+    LatencyHistogram latency;
+    for (long i = 0; i < count; ++i)
+    {
+        const auto data(std::to_string(i) + ' ' + getRandomData());
+        const auto start(std::chrono::steady_clock::now());
+        FileTransaction transaction(*log);
+        for (const auto& filePath: filePaths)
+            transaction.write(filePath, data);
+        transaction.commit();
+        latency.record(std::chrono::steady_clock::now() - start);
+    }
+    printLatencySummary(std::cout, "Transaction", latency);
+    return checkTransactionFiles(filePaths, "Final");
+}
+
+/**
+ * Publishes count snapshots of files "<i % 4>/file-<i>" below root and
+ * reads every one back through the current link, which must show the
+ * whole new snapshot.
+ */
+bool runSnapshots(const std::string& root, long count, const TestOptions& options)
+{
+    SnapshotPublisher publisher(root, 2, options.barrierMethod);
+    LatencyHistogram latency;
+    unsigned long mismatches(0);
+    for (long i = 0; i < count; ++i)
+    {
+        const auto data(std::to_string(i) + ' ' + getRandomData());
+        std::vector<std::pair<std::string, std::string>> files;
+        for (long j = 0; j < options.snapshotFiles; ++j)
+            files.emplace_back(std::to_string(j % 4) + "/file-" + std::to_string(j), data);
+        const auto start(std::chrono::steady_clock::now());
+        publisher.publish(files);
+        latency.record(std::chrono::steady_clock::now() - start);
+        for (const auto& file: files)
+            if (readFile(root + "/current/" + file.first) != file.second)
+                ++mismatches;
+    }
+    printLatencySummary(std::cout, "Publish", latency);
+    std::cout << "Snapshot files read back: " << count * options.snapshotFiles << ", " << mismatches << " mismatches" << std::endl;
+    return mismatches == 0;
+}
+
+/**
+ * Replays a recorded trace into directory, path id n becoming file
+ * "trace-<n>". Each path is always handled by the same thread so that
+ * per-path ordering is kept.
+ */
+void runReplay(const std::string& directory, Trace trace, long count, const TestOptions& options)
+{
+    if (trace.records.size() > static_cast<size_t>(count))
+        trace.records.resize(static_cast<size_t>(count));
+
+    const size_t threadCount(static_cast<size_t>(options.replayThreads));
+    std::vector<std::vector<TraceRecord>> schedules(threadCount);
+    for (const auto& record: trace.records)
+        schedules[record.pathId % threadCount].push_back(record);
+
+    /**
+     * Every path exists before the replay starts so that reads of paths
+     * committed later in the trace do not fail.
+     */
+    std::vector<std::unique_ptr<CommittedFile>> files;
+    for (size_t i = 0; i < trace.paths.size(); ++i)
+    {
+        files.emplace_back(new CommittedFile(directory + "/trace-" + std::to_string(i), options.commitOptions));
+        files.back()->write("");
+    }
+
+    std::vector<LatencyHistogram> commitLatencies(threadCount);
+    std::vector<LatencyHistogram> readLatencies(threadCount);
+    std::vector<LatencyHistogram> lags(threadCount);
+    std::vector<std::thread> threads;
+    const auto start(std::chrono::steady_clock::now());
+    for (size_t i = 0; i < threadCount; ++i)
+        threads.emplace_back([&, i]()
+        {
+            std::string data;
+            for (const auto& record: schedules[i])
+            {
+                auto issued(std::chrono::steady_clock::now());
+                if (options.replaySpeed > 0)
+                {
+                    const auto due(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                       std::chrono::nanoseconds(static_cast<uint64_t>(static_cast<double>(record.timestamp) / options.replaySpeed))));
+                    if (issued < due)
+                    {
+                        std::this_thread::sleep_until(due);
+                        issued = std::chrono::steady_clock::now();
+                    }
+                    lags[i].record(issued - due);
+                }
+                auto& file(*files[record.pathId]);
+                if (record.op == TraceOp::COMMIT)
+                {
+                    data.assign(record.size, 'x');
+                    file.write(data);
+                    commitLatencies[i].record(std::chrono::steady_clock::now() - issued);
+                }
+                else
+                {
+                    file.read();
+                    readLatencies[i].record(std::chrono::steady_clock::now() - issued);
+                }
+            }
+        });
+    for (auto& thread: threads)
+        thread.join();
+    const std::chrono::duration<double> elapsed(std::chrono::steady_clock::now() - start);
+
+    LatencyHistogram commitLatency;
+    LatencyHistogram readLatency;
+    LatencyHistogram lag;
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        commitLatency.merge(commitLatencies[i]);
+        readLatency.merge(readLatencies[i]);
+        lag.merge(lags[i]);
+    }
+    std::cout << "Replayed " << trace.records.size() << " records over " << trace.paths.size()
+              << " paths in " << elapsed.count() << "s" << std::endl;
+    printLatencySummary(std::cout, "Commit", commitLatency);
+    printLatencySummary(std::cout, "Read", readLatency);
+    if (options.replaySpeed > 0)
+        printLatencySummary(std::cout, "Behind schedule", lag);
+}
+
+CommitDaemon* runningDaemon(nullptr);
+
+void stopDaemon(int)
+{
+    runningDaemon->stop();
+}
+
+/**
+ * Serves until count commits have been acknowledged or SIGINT/SIGTERM
+ */
+void runDaemon(const std::string& directory, long count, const TestOptions& options)
+{
+    CommitDaemon daemon(options.daemonSocket,
+                        directory,
+                        options.commitOptions,
+                        static_cast<unsigned>(options.writers > 0 ? options.writers : 16));
+    runningDaemon = &daemon;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &stopDaemon;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    const auto start(std::chrono::steady_clock::now());
+    daemon.run(static_cast<unsigned long>(count));
+    const std::chrono::duration<double> elapsed(std::chrono::steady_clock::now() - start);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    runningDaemon = nullptr;
+    std::cout << "Acknowledged " << daemon.acknowledged() << " commits from "
+              << daemon.connections() << " clients in " << elapsed.count() << "s" << std::endl;
+}
+
+void runClient(const std::string& path, long count, const TestOptions& options)
+{
+    const long writers(std::max(1L, options.writers));
+    CommitClient client(options.clientSocket);
+    std::vector<LatencyHistogram> latencies(static_cast<size_t>(writers));
+    std::atomic<unsigned long> failures(0);
+    std::mutex errorMutex;
+    std::string firstError;
+    std::vector<std::thread> threads;
+    const auto start(std::chrono::steady_clock::now());
+    for (long i = 0; i < writers; ++i)
+        threads.emplace_back([&, i]()
+        {
+            const auto name(writers == 1 ? path : path + '.' + std::to_string(i));
+            const auto data(getRandomData());
+            for (long j = 0; j < count; ++j)
+            {
+                const auto begin(std::chrono::steady_clock::now());
+                const auto status(client.commit(name, data));
+                if (status.ok())
+                    latencies[static_cast<size_t>(i)].record(std::chrono::steady_clock::now() - begin);
+                else if (!failures++)
+                {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    firstError = status.error().message();
+                }
+            }
+        });
+    for (auto& thread: threads)
+        thread.join();
+    const std::chrono::duration<double> elapsed(std::chrono::steady_clock::now() - start);
+
+    LatencyHistogram latency;
+    for (const auto& histogram: latencies)
+        latency.merge(histogram);
+    printLatencySummary(std::cout, "Daemon commit", latency);
+    std::cout << "Throughput: " << static_cast<double>(latency.count()) / elapsed.count() << " commits/s" << std::endl;
+    if (failures.load())
+        std::cout << "Failed commits: " << failures.load() << ", first: " << firstError << std::endl;
+}
+
+/**
+ * The commit protocol cut short after each of its steps
+ */
+enum class Baseline
+{
+    NO_SYNC,
+    FSYNC_IN_PLACE,
+    FSYNC_RENAME,
+    FULL
+};
+
+const char* baselineName(Baseline baseline)
+{
+    switch (baseline)
+    {
+    case Baseline::NO_SYNC: return "write";
+    case Baseline::FSYNC_IN_PLACE: return "write+fsync";
+    case Baseline::FSYNC_RENAME: return "write+fsync+rename";
+    case Baseline::FULL: return "full protocol";
+    }
+    return "unknown";
+}
+
+void commitBaseline(Baseline baseline, const std::string& filename, const std::string& data, CommittedFile& file)
+{
+    if (baseline == Baseline::FULL)
+    {
+        file.write(data);
+        return;
+    }
+    const auto target(baseline == Baseline::FSYNC_RENAME ? filename + ".baseline" : filename);
+    ScopedFd fd(syscalls().openat(AT_FDCWD,
+                                  target.c_str(),
+                                  O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    if (fd == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", target, errno).c_str());
+    if (!writeFully(fd, data.data(), data.size()))
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("write", target, errno).c_str());
+    if ((baseline != Baseline::NO_SYNC) && (syscalls().fsync(fd) == -1))
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("fsync", target, errno).c_str());
+    if (fd.close() == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("close", target, errno).c_str());
+    if ((baseline == Baseline::FSYNC_RENAME) &&
+        (syscalls().renameat(AT_FDCWD, target.c_str(), AT_FDCWD, filename.c_str(), 0) == -1))
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("rename", target, errno).c_str());
+}
+
+/**
+ * Modes take turns commit by commit, so that they see the same device
+ * and cache conditions
+ */
+void runComparison(const std::string& filename, long count, const TestOptions& options)
+{
+    const Baseline baselines[] = { Baseline::NO_SYNC, Baseline::FSYNC_IN_PLACE, Baseline::FSYNC_RENAME, Baseline::FULL };
+    LatencyHistogram latencies[4];
+    CommittedFile file(filename, options.commitOptions);
+    const auto data(getRandomData());
+    for (long i = 0; i < count; ++i)
+        for (size_t j = 0; j < 4; ++j)
+        {
+            const auto start(std::chrono::steady_clock::now());
+            commitBaseline(baselines[j], filename, data, file);
+            latencies[j].record(std::chrono::steady_clock::now() - start);
+        }
+
+    const auto us = [](double nanoseconds) { return nanoseconds / 1000.0; };
+    std::cout << std::left << std::setw(20) << "mode" << std::right
+              << std::setw(12) << "mean_us" << std::setw(12) << "p50_us" << std::setw(12) << "p99_us"
+              << std::setw(16) << "step_mean_us" << std::setw(16) << "step_p50_us" << std::setw(16) << "step_p99_us" << std::endl;
+    for (size_t j = 0; j < 4; ++j)
+    {
+        const auto& latency(latencies[j]);
+        std::cout << std::left << std::setw(20) << baselineName(baselines[j]) << std::right
+                  << std::setw(12) << us(latency.mean())
+                  << std::setw(12) << us(static_cast<double>(latency.percentile(0.5)))
+                  << std::setw(12) << us(static_cast<double>(latency.percentile(0.99)));
+        if (j > 0)
+        {
+            const auto& previous(latencies[j - 1]);
+            std::cout << std::showpos
+                      << std::setw(16) << us(latency.mean() - previous.mean())
+                      << std::setw(16) << us(static_cast<double>(latency.percentile(0.5)) - static_cast<double>(previous.percentile(0.5)))
+                      << std::setw(16) << us(static_cast<double>(latency.percentile(0.99)) - static_cast<double>(previous.percentile(0.99)))
+                      << std::noshowpos;
+        }
+        std::cout << std::endl;
+    }
+}
+
+template <typename File>
+void benchmarkCommits(const std::string& name, File& file, long count)
+{
+    const auto data(getRandomData());
+    LatencyHistogram latency;
+    for (long i = 0; i < count; ++i)
+    {
+        const auto start(std::chrono::steady_clock::now());
+        file.write(data);
+        latency.record(std::chrono::steady_clock::now() - start);
+    }
+    printLatencySummary(std::cout, name, latency);
+}
+
+void runDispatchBenchmark(const std::string& filename, long count)
+{
+    typedef BasicCommittedFile<FsyncDurability, RawFormat, DirectIo> StaticFile;
+    {
+        CommittedFile file(filename);
+        benchmarkCommits("CommittedFile", file, count);
+    }
+    {
+        StaticFile file(filename);
+        benchmarkCommits("BasicCommittedFile<fsync, raw, direct>", file, count);
+    }
+    {
+        BasicCommittedFile<FsyncDurability, RawFormat, BackendIo> file(filename);
+        benchmarkCommits("BasicCommittedFile<fsync, raw, backend>", file, count);
+    }
+    {
+        BasicCommittedFile<FdatasyncDurability, ChecksummedFormat, DirectIo> file(filename);
+        benchmarkCommits("BasicCommittedFile<fdatasync, checksummed, direct>", file, count);
+        file.read();
+    }
+    {
+        auto file(AnyCommittedFile::create<StaticFile>(filename));
+        benchmarkCommits("AnyCommittedFile<fsync, raw, direct>", file, count);
+    }
+}
+
+/**
+ * Runs all jobs concurrently. Every thread of a job commits to its share
+ * of the job's files in turn, paced to its share of the rate. Returns
+ * false if any commit failed.
+ */
+bool runJobs(const std::vector<JobSpec>& jobs, const TestOptions& options, CommitVerifier* verifier)
+{
+    struct JobResult
+    {
+        std::atomic<unsigned long> commits;
+        std::atomic<unsigned long> failures;
+        std::atomic<unsigned long long> bytes;
+        std::mutex mutex;
+        LatencyHistogram latency;
+        LatencyHistogram lag;
+        std::string firstError;
+        std::chrono::steady_clock::time_point finished;
+    };
+
+    /**
+     * Constructing a CommittedFile removes stale work-files, so every
+     * object is created before the first job starts.
+     */
+    std::vector<std::vector<std::unique_ptr<CommittedFile>>> files(jobs.size());
+    std::vector<std::unique_ptr<JobResult>> results;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        const auto& job(jobs[i]);
+        auto commitOptions(options.commitOptions);
+        commitOptions.durability = job.durability;
+        commitOptions.createDirectories = true;
+        for (const auto& directory: job.directories)
+            for (long j = 0; j < job.files; ++j)
+                files[i].emplace_back(new CommittedFile(directory + '/' + job.name + '.' + std::to_string(j), commitOptions));
+        results.emplace_back(new JobResult());
+        results.back()->commits = 0;
+        results.back()->failures = 0;
+        results.back()->bytes = 0;
+    }
+
+    std::vector<std::thread> threads;
+    const auto start(std::chrono::steady_clock::now());
+    for (size_t i = 0; i < jobs.size(); ++i)
+        for (long t = 0; t < jobs[i].threads; ++t)
+            threads.emplace_back([&, i, t]()
+            {
+                const auto& job(jobs[i]);
+                auto& result(*results[i]);
+                auto& jobFiles(files[i]);
+                const auto threads(static_cast<size_t>(job.threads));
+                /**
+                 * With more threads than files, threads share files
+                 */
+                std::vector<CommittedFile*> own;
+                for (size_t f = static_cast<size_t>(t) % jobFiles.size(); f < jobFiles.size(); f += threads)
+                    own.push_back(jobFiles[f].get());
+                const long count(job.count ? job.count / job.threads + (t < job.count % job.threads ? 1 : 0) : 0);
+                const double interval(job.rate > 0 ? static_cast<double>(job.threads) / job.rate : 0);
+                std::mt19937_64 generator(options.seed + i * 1000 + static_cast<uint64_t>(t));
+                LatencyHistogram latency;
+                LatencyHistogram lag;
+                std::string data;
+                for (long n = 0; !job.count || (n < count); ++n)
+                {
+                    auto issued(std::chrono::steady_clock::now());
+                    if (interval > 0)
+                    {
+                        const auto due(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                           std::chrono::duration<double>(static_cast<double>(n) * interval)));
+                        if (issued < due)
+                        {
+                            std::this_thread::sleep_until(due);
+                            issued = std::chrono::steady_clock::now();
+                        }
+                        if (job.duration.count() && (issued - start >= job.duration))
+                            break;
+                        lag.record(issued - due);
+                    }
+                    else if (job.duration.count() && (issued - start >= job.duration))
+                        break;
+                    auto& file(*own[static_cast<size_t>(n) % own.size()]);
+                    data.assign(static_cast<size_t>(job.size.sampleValue(generator)), 'x');
+                    const auto status(file.tryWrite(data));
+                    if (status.ok())
+                    {
+                        latency.record(std::chrono::steady_clock::now() - issued);
+                        ++result.commits;
+                        result.bytes += data.size();
+                        if (verifier)
+                            verifier->verify(file, data);
+                    }
+                    else if (!result.failures++)
+                    {
+                        std::lock_guard<std::mutex> lock(result.mutex);
+                        result.firstError = status.error().message();
+                    }
+                }
+                const auto finished(std::chrono::steady_clock::now());
+                std::lock_guard<std::mutex> lock(result.mutex);
+                result.latency.merge(latency);
+                result.lag.merge(lag);
+                result.finished = std::max(result.finished, finished);
+            });
+    for (auto& thread: threads)
+        thread.join();
+
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        const auto& job(jobs[i]);
+        const auto& result(*results[i]);
+        const std::chrono::duration<double> elapsed(result.finished - start);
+        std::cout << "Job " << job.name << ": " << job.threads << " threads, " << files[i].size() << " files, "
+                  << result.commits.load() << " commits, " << result.failures.load() << " failed, "
+                  << static_cast<double>(result.bytes.load()) / (1024 * 1024) << " MiB, "
+                  << static_cast<double>(result.commits.load()) / elapsed.count() << " commits/s over "
+                  << elapsed.count() << "s" << std::endl;
+        if (!result.firstError.empty())
+            std::cout << "  first error: " << result.firstError << std::endl;
+        printLatencySummary(std::cout, "  Commit", result.latency);
+        if (job.rate > 0)
+            printLatencySummary(std::cout, "  Behind schedule", result.lag);
+    }
+    return std::none_of(results.begin(), results.end(), [](const std::unique_ptr<JobResult>& result) { return result->failures.load() > 0; });
+}
+
+int main(int argc, const char* argv[])
+{
+    enum
+    {
+        OPT_WRITERS = 256,
+        OPT_READERS,
+        OPT_READ_RATIO,
+        OPT_SHARED_FILE,
+        OPT_VERIFY,
+        OPT_COMPARE,
+        OPT_INTERFERENCE_RATE,
+        OPT_INTERFERENCE_FILE_SIZE,
+        OPT_INTERFERENCE_DIR,
+        OPT_BACKEND,
+        OPT_INJECT_LATENCY,
+        OPT_SEED,
+        OPT_RECORD,
+        OPT_REPLAY,
+        OPT_REPLAY_SPEED,
+        OPT_REPLAY_THREADS,
+        OPT_TIMELINE,
+        OPT_TOP_PATHS,
+        OPT_PATH_STATS,
+        OPT_CHROME_TRACE,
+        OPT_JOB_FILE,
+        OPT_HISTOGRAM_LOG,
+        OPT_HISTOGRAM_INTERVAL,
+        OPT_BASELINE,
+        OPT_REGRESSION_THRESHOLD,
+        OPT_SLOW_COMMIT_THRESHOLD,
+        OPT_SLOW_COMMIT_CAPACITY,
+        OPT_DURABILITY,
+        OPT_GROUP_P99_TARGET,
+        OPT_GROUP_SHM,
+        OPT_CREATE_DIRECTORIES,
+        OPT_KEEP_PREVIOUS,
+        OPT_ROLLBACK,
+        OPT_TXN,
+        OPT_PUBLISH,
+        OPT_BARRIER,
+        OPT_BENCH_DISPATCH,
+        OPT_DAEMON,
+        OPT_CLIENT
+    };
+    static const struct option longOptions[] =
+    {
+        { "writers", required_argument, nullptr, OPT_WRITERS },
+        { "readers", required_argument, nullptr, OPT_READERS },
+        { "read-ratio", required_argument, nullptr, OPT_READ_RATIO },
+        { "shared-file", no_argument, nullptr, OPT_SHARED_FILE },
+        { "verify", required_argument, nullptr, OPT_VERIFY },
+        { "compare", no_argument, nullptr, OPT_COMPARE },
+        { "interference-rate", required_argument, nullptr, OPT_INTERFERENCE_RATE },
+        { "interference-file-size", required_argument, nullptr, OPT_INTERFERENCE_FILE_SIZE },
+        { "interference-dir", required_argument, nullptr, OPT_INTERFERENCE_DIR },
+        { "backend", required_argument, nullptr, OPT_BACKEND },
+        { "inject-latency", required_argument, nullptr, OPT_INJECT_LATENCY },
+        { "seed", required_argument, nullptr, OPT_SEED },
+        { "record", required_argument, nullptr, OPT_RECORD },
+        { "replay", required_argument, nullptr, OPT_REPLAY },
+        { "replay-speed", required_argument, nullptr, OPT_REPLAY_SPEED },
+        { "replay-threads", required_argument, nullptr, OPT_REPLAY_THREADS },
+        { "timeline", required_argument, nullptr, OPT_TIMELINE },
+        { "top-paths", required_argument, nullptr, OPT_TOP_PATHS },
+        { "path-stats", required_argument, nullptr, OPT_PATH_STATS },
+        { "chrome-trace", required_argument, nullptr, OPT_CHROME_TRACE },
+        { "job-file", required_argument, nullptr, OPT_JOB_FILE },
+        { "histogram-log", required_argument, nullptr, OPT_HISTOGRAM_LOG },
+        { "histogram-interval", required_argument, nullptr, OPT_HISTOGRAM_INTERVAL },
+        { "baseline", required_argument, nullptr, OPT_BASELINE },
+        { "regression-threshold", required_argument, nullptr, OPT_REGRESSION_THRESHOLD },
+        { "slow-commit-threshold", required_argument, nullptr, OPT_SLOW_COMMIT_THRESHOLD },
+        { "slow-commit-capacity", required_argument, nullptr, OPT_SLOW_COMMIT_CAPACITY },
+        { "durability", required_argument, nullptr, OPT_DURABILITY },
+        { "group-p99-target", required_argument, nullptr, OPT_GROUP_P99_TARGET },
+        { "group-shm", required_argument, nullptr, OPT_GROUP_SHM },
+        { "create-directories", no_argument, nullptr, OPT_CREATE_DIRECTORIES },
+        { "keep-previous", no_argument, nullptr, OPT_KEEP_PREVIOUS },
+        { "rollback", no_argument, nullptr, OPT_ROLLBACK },
+        { "txn", required_argument, nullptr, OPT_TXN },
+        { "publish", required_argument, nullptr, OPT_PUBLISH },
+        { "barrier", required_argument, nullptr, OPT_BARRIER },
+        { "bench-dispatch", no_argument, nullptr, OPT_BENCH_DISPATCH },
+        { "daemon", required_argument, nullptr, OPT_DAEMON },
+        { "client", required_argument, nullptr, OPT_CLIENT },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    TestOptions options;
+    int opt;
+    while ((opt = getopt_long(argc, const_cast<char* const*>(argv), "", longOptions, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_WRITERS:
+            options.writers = std::atol(optarg);
+            if (options.writers < 1)
+                usage();
+            break;
+        case OPT_READERS:
+            options.readers = std::atol(optarg);
+            if (options.readers < 0)
+                usage();
+            break;
+        case OPT_READ_RATIO:
+            options.readRatio = std::atof(optarg);
+            if (options.readRatio < 0)
+                usage();
+            break;
+        case OPT_SHARED_FILE:
+            options.sharedFile = true;
+            break;
+        case OPT_COMPARE:
+            options.compare = true;
+            break;
+        case OPT_VERIFY:
+            if (strcmp(optarg, "cached") == 0)
+                options.verify = VerifyMode::CACHED;
+            else if (strcmp(optarg, "direct") == 0)
+                options.verify = VerifyMode::DIRECT;
+            else
+                usage();
+            break;
+        case OPT_INTERFERENCE_RATE:
+            options.interferenceRate = std::atof(optarg);
+            if (options.interferenceRate < 0)
+                usage();
+            break;
+        case OPT_INTERFERENCE_FILE_SIZE:
+            options.interferenceFileSize = std::atol(optarg);
+            if (options.interferenceFileSize < 1)
+                usage();
+            break;
+        case OPT_INTERFERENCE_DIR:
+            options.interferenceDir = optarg;
+            break;
+        case OPT_BACKEND:
+            options.backend = optarg;
+            if ((options.backend != "posix") && (options.backend != "memory"))
+                usage();
+            break;
+        case OPT_INJECT_LATENCY:
+            options.injectedLatencies.push_back(optarg);
+            break;
+        case OPT_SEED:
+            options.seed = std::strtoull(optarg, nullptr, 0);
+            break;
+        case OPT_RECORD:
+            options.recordFile = optarg;
+            break;
+        case OPT_REPLAY:
+            options.replayFile = optarg;
+            break;
+        case OPT_REPLAY_SPEED:
+            options.replaySpeed = std::atof(optarg);
+            if (options.replaySpeed < 0)
+                usage();
+            break;
+        case OPT_REPLAY_THREADS:
+            options.replayThreads = std::atol(optarg);
+            if (options.replayThreads < 1)
+                usage();
+            break;
+        case OPT_TIMELINE:
+            options.timelineInterval = std::atof(optarg);
+            if (options.timelineInterval <= 0)
+                usage();
+            break;
+        case OPT_TOP_PATHS:
+            options.topPaths = std::atol(optarg);
+            if (options.topPaths < 1)
+                usage();
+            break;
+        case OPT_PATH_STATS:
+            options.pathStatsFile = optarg;
+            break;
+        case OPT_CHROME_TRACE:
+            options.chromeTraceFile = optarg;
+            break;
+        case OPT_JOB_FILE:
+            options.jobFile = optarg;
+            break;
+        case OPT_HISTOGRAM_LOG:
+            options.histogramLogFile = optarg;
+            break;
+        case OPT_HISTOGRAM_INTERVAL:
+            options.histogramInterval = std::atof(optarg);
+            if (options.histogramInterval <= 0)
+                usage();
+            break;
+        case OPT_BASELINE:
+            options.baselineFile = optarg;
+            break;
+        case OPT_REGRESSION_THRESHOLD:
+            options.regressionThreshold = std::atof(optarg);
+            if (options.regressionThreshold < 0)
+                usage();
+            break;
+        case OPT_SLOW_COMMIT_THRESHOLD:
+            options.slowCommitThreshold = std::atof(optarg);
+            if (options.slowCommitThreshold < 0)
+                usage();
+            break;
+        case OPT_SLOW_COMMIT_CAPACITY:
+            options.slowCommitCapacity = std::atol(optarg);
+            if (options.slowCommitCapacity < 1)
+                usage();
+            break;
+        case OPT_DURABILITY:
+            if (strcmp(optarg, "immediate") == 0)
+                options.commitOptions.durability = Durability::IMMEDIATE;
+            else if (strcmp(optarg, "deferred") == 0)
+                options.commitOptions.durability = Durability::DEFERRED;
+            else if (strcmp(optarg, "grouped") == 0)
+                options.commitOptions.durability = Durability::GROUPED;
+            else
+                usage();
+            break;
+        case OPT_GROUP_P99_TARGET:
+            if (std::atof(optarg) <= 0)
+                usage();
+            options.groupCommitConfig.p99Target = std::chrono::nanoseconds(static_cast<long long>(std::atof(optarg) * 1000000));
+            break;
+        case OPT_GROUP_SHM:
+            options.groupCommitConfig.sharedSegment = optarg;
+            break;
+        case OPT_CREATE_DIRECTORIES:
+            options.commitOptions.createDirectories = true;
+            break;
+        case OPT_KEEP_PREVIOUS:
+            options.commitOptions.mode = CommitMode::KEEP_PREVIOUS;
+            break;
+        case OPT_ROLLBACK:
+            options.rollback = true;
+            break;
+        case OPT_TXN:
+            options.transactionFiles = std::atol(optarg);
+            if (options.transactionFiles < 1)
+                usage();
+            break;
+        case OPT_PUBLISH:
+            options.snapshotFiles = std::atol(optarg);
+            if (options.snapshotFiles < 1)
+                usage();
+            break;
+        case OPT_BARRIER:
+            if (strcmp(optarg, "syncfs") == 0)
+                options.barrierMethod = BarrierMethod::SYNCFS;
+            else if (strcmp(optarg, "per-file") == 0)
+                options.barrierMethod = BarrierMethod::PER_FILE;
+            else
+                usage();
+            break;
+        case OPT_BENCH_DISPATCH:
+            options.benchDispatch = true;
+            break;
+        case OPT_DAEMON:
+            options.daemonSocket = optarg;
+            break;
+        case OPT_CLIENT:
+            options.clientSocket = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != (options.jobFile.empty() ? 2 : 0))
+        usage();
+    /**
+     * With a shared file, a newer commit of another writer may be read
+     * back
+     */
+    if (options.sharedFile && (options.verify != VerifyMode::NONE))
+        usage();
+    /**
+     * Rolls back <filename>, so it has to be the one file committed
+     */
+    if (options.rollback)
+    {
+        if (!options.jobFile.empty() || !options.daemonSocket.empty() || !options.clientSocket.empty() ||
+            options.benchDispatch || options.compare || !options.replayFile.empty() ||
+            (options.transactionFiles > 0) || (options.snapshotFiles > 0) ||
+            (options.interferenceRate >= 0) || ((options.writers > 1) && !options.sharedFile))
+            usage();
+        options.commitOptions.mode = CommitMode::KEEP_PREVIOUS;
+    }
+    /**
+     * Acks promise durability and batching across clients is the point
+     * of the daemon
+     */
+    if (!options.daemonSocket.empty())
+        options.commitOptions.durability = Durability::GROUPED;
+
+    std::vector<JobSpec> jobs;
+    if (!options.jobFile.empty())
+    {
+        JobSpec defaults;
+        defaults.files = 1;
+        defaults.size = LatencyDistribution::parse("fixed:4k", &parseSize);
+        defaults.rate = 0;
+        defaults.threads = 1;
+        defaults.durability = options.commitOptions.durability;
+        defaults.duration = std::chrono::microseconds::zero();
+        defaults.count = 0;
+        try
+        {
+            jobs = loadJobFile(options.jobFile, defaults);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::string filename = jobs.empty() ? argv[optind] : "";
+    long count(jobs.empty() ? std::atoi(argv[optind + 1]) : 1);
+    if (count < 1)
+        usage();
+
+    std::unique_ptr<MemorySyscallBackend> memoryBackend;
+    if (options.backend == "memory")
+    {
+        memoryBackend.reset(new MemorySyscallBackend());
+        if (!jobs.empty())
+            for (const auto& job: jobs)
+                for (const auto& directory: job.directories)
+                    memoryBackend->createDirectories(directory);
+        else
+            memoryBackend->createDirectories((options.replayFile.empty() && options.daemonSocket.empty() && !options.snapshotFiles) ? dirName(filename) : filename);
+        if (!options.interferenceDir.empty())
+            memoryBackend->createDirectories(options.interferenceDir);
+        setSyscallBackend(*memoryBackend);
+    }
+    std::unique_ptr<LatencyInjectingSyscallBackend> latencyBackend;
+    if (!options.injectedLatencies.empty())
+    {
+        latencyBackend.reset(new LatencyInjectingSyscallBackend(syscalls(), options.seed));
+        for (const auto& spec: options.injectedLatencies)
+        {
+            try
+            {
+                latencyBackend->setLatency(spec);
+            }
+            catch (const std::invalid_argument& e)
+            {
+                std::cerr << e.what() << std::endl;
+                usage();
+            }
+        }
+        setSyscallBackend(*latencyBackend);
+    }
+
+    std::unique_ptr<TraceRecorder> recorder;
+    if (!options.recordFile.empty())
+    {
+        recorder.reset(new TraceRecorder(options.recordFile));
+        addCommitObserver(*recorder);
+    }
+
+    GroupCommitter::instance().configure(options.groupCommitConfig);
+
+    std::unique_ptr<TimelineRecorder> timeline;
+    if (options.timelineInterval > 0)
+    {
+        timeline.reset(new TimelineRecorder(std::chrono::nanoseconds(static_cast<long long>(options.timelineInterval * 1000000))));
+        addCommitObserver(*timeline);
+    }
+
+    std::unique_ptr<PathStatsRegistry> pathStats;
+    if ((options.topPaths > 0) || !options.pathStatsFile.empty())
+    {
+        pathStats.reset(new PathStatsRegistry());
+        addCommitObserver(*pathStats);
+    }
+
+    /**
+     * Loaded up front, so a bad baseline or trace fails before the run
+     */
+    LatencyHistogram baseline;
+    if (!options.baselineFile.empty())
+    {
+        try
+        {
+            baseline = loadHistogramLog(options.baselineFile).merged();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    Trace trace;
+    if (!options.replayFile.empty())
+    {
+        try
+        {
+            trace = loadTrace(options.replayFile);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<HistogramLogRecorder> histogramLog;
+    if (!options.histogramLogFile.empty() || !options.baselineFile.empty())
+    {
+        histogramLog.reset(new HistogramLogRecorder(std::chrono::nanoseconds(static_cast<long long>(options.histogramInterval * 1000000))));
+        addCommitObserver(*histogramLog);
+    }
+
+    std::unique_ptr<ChromeTraceRecorder> chromeTrace;
+    if (!options.chromeTraceFile.empty())
+    {
+        chromeTrace.reset(new ChromeTraceRecorder());
+        addCommitObserver(*chromeTrace);
+    }
+
+    std::unique_ptr<SlowCommitRecorder> slowCommits;
+    if (options.slowCommitThreshold >= 0)
+    {
+        slowCommits.reset(new SlowCommitRecorder(std::chrono::nanoseconds(static_cast<long long>(options.slowCommitThreshold * 1000000)),
+                                                 static_cast<size_t>(options.slowCommitCapacity),
+                                                 std::cout));
+        addCommitObserver(*slowCommits);
+    }
+
+    std::unique_ptr<CommitVerifier> verifier;
+    if (options.verify != VerifyMode::NONE)
+        verifier.reset(new CommitVerifier(options.verify));
+
+    bool failed(false);
+    if (!jobs.empty())
+        failed = !runJobs(jobs, options, verifier.get());
+    else if (!options.daemonSocket.empty())
+        runDaemon(filename, count, options);
+    else if (!options.clientSocket.empty())
+        runClient(filename, count, options);
+    else if (options.benchDispatch)
+        runDispatchBenchmark(filename, count);
+    else if (options.compare)
+        runComparison(filename, count, options);
+    else if (!options.replayFile.empty())
+        runReplay(filename, std::move(trace), count, options);
+    else if (options.transactionFiles > 0)
+    {
+        if (!runTransactions(filename, count, options))
+            return 1;
+    }
+    else if (options.snapshotFiles > 0)
+    {
+        if (!runSnapshots(filename, count, options))
+            return 1;
+    }
+    else if (options.interferenceRate >= 0)
+        runInterferenceTest(filename, count, options, verifier.get());
+    else if ((options.writers > 0) || (options.readers > 0))
+        runMixedWorkload(filename, count, options, verifier.get());
+    else
+        for(long i = 0; i < count; ++i)
+            writeFile(filename, options.commitOptions, verifier.get());
+
+    const auto used = [&](Durability durability)
+    {
+        return (options.commitOptions.durability == durability) ||
+            std::any_of(jobs.begin(), jobs.end(), [durability](const JobSpec& job) { return job.durability == durability; });
+    };
+    if (used(Durability::DEFERRED))
+    {
+        ElapsedTimeMonitor dummy("Durability barrier");
+        durabilityBarrier(options.barrierMethod);
+    }
+    if (used(Durability::GROUPED))
+        printGroupCommitStats(std::cout, GroupCommitter::instance().stats());
+    if (options.rollback && !rollbackFile(filename, options.commitOptions))
+        return 1;
+    if (timeline)
+        timeline->print(std::cout);
+    if (pathStats && (options.topPaths > 0))
+        PathStatsRegistry::printTop(std::cout, pathStats->top(static_cast<size_t>(options.topPaths)));
+    if (pathStats && !options.pathStatsFile.empty())
+    {
+        std::ofstream output(options.pathStatsFile);
+        PathStatsRegistry::printCsv(output, pathStats->dump());
+    }
+    if (chromeTrace)
+    {
+        std::ofstream output(options.chromeTraceFile);
+        chromeTrace->write(output);
+    }
+    bool regressed(false);
+    if (histogramLog)
+    {
+        const auto log(histogramLog->log());
+        if (!options.histogramLogFile.empty())
+        {
+            std::ofstream output(options.histogramLogFile);
+            writeHistogramLog(output, log);
+        }
+        if (!options.baselineFile.empty())
+            regressed = compareWithBaseline(std::cout, baseline, log.merged(), options.regressionThreshold / 100.0, options.seed);
+    }
+    if (verifier)
+    {
+        verifier->print(std::cout);
+        if (verifier->mismatches())
+            return 1;
+    }
+    if (regressed || failed)
+        return 1;
+}
+
+BaseFd::BaseFd(const std::string& directory,
+               const std::string& file,
+               int fd):
+    directory(directory),
+    file(file),
+    fd(fd)
+{
+}
+
+BaseFd::~BaseFd()
+{
+    if (fd >= 0)
+        /* Ignore errors */
+        syscalls().close(fd);
+}
+
+IoStatus BaseFd::trySync()
+{
+    /**
+     * ENOSPC and EDQUOT could be recovered by retrying later, see
+     * IoError::retryable().
+     */
+    if (syscalls().fsync(fd) == -1)
+        return IoStatus::fromErrno("fsync", directory, file, "");
+    return IoStatus();
+}
+
+void BaseFd::sync()
+{
+    trySync().check();
+}
+
+IoStatus BaseFd::tryDataSync()
+{
+    if (syscalls().fdatasync(fd) == -1)
+        return IoStatus::fromErrno("fdatasync", directory, file, "");
+    return IoStatus();
+}
+
+void BaseFd::dataSync()
+{
+    tryDataSync().check();
+}
+
+IoStatus BaseFd::trySyncFilesystem()
+{
+    if (syscalls().syncfs(fd) == -1)
+        return IoStatus::fromErrno("syncfs", directory, file, "");
+    return IoStatus();
+}
+
+void BaseFd::syncFilesystem()
+{
+    trySyncFilesystem().check();
+}
+
+IoStatus BaseFd::tryClose()
+{
+    if (fd >= 0)
+    {
+        const int copy(fd);
+        fd = -1;
+        if (syscalls().close(copy) == -1)
+            return IoStatus::fromErrno("close", directory, file, "");
+    }
+    return IoStatus();
+}
+
+void BaseFd::close()
+{
+    tryClose().check();
+}
+
+const std::string DirFd::NO_FILE;
+
+bool DirFd::makeDirectory(const std::string& file)
+{
+    if (syscalls().mkdirat(fd, file.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1)
+    {
+        if (errno == EEXIST)
+            return false;
+        throw std::system_error(errno, std::system_category(), buildCommittedFileError("mkdir", directory, file, "", errno).c_str());
+    }
+    return true;
+}
+
+void DirFd::createSymlink(const std::string& target, const std::string& file)
+{
+    if (syscalls().symlinkat(target.c_str(), fd, file.c_str()) == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileError("symlink", directory, file, "", errno).c_str());
+}
+
+std::vector<std::pair<std::string, bool>> DirFd::list()
+{
+    std::vector<std::pair<std::string, bool>> entries;
+    if (syscalls().readDirectory(fd, entries) == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileError("readdir", directory, "", "", errno).c_str());
+    return entries;
+}
+
+void DirFd::removeTree(const std::string& file)
+{
+    {
+        DirFd subDirFd(directory + '/' + file);
+        const auto entries(subDirFd.list());
+        for (const auto& entry: entries)
+        {
+            if (entry.second)
+                subDirFd.removeTree(entry.first);
+            else
+                subDirFd.unlink(entry.first);
+        }
+        subDirFd.close();
+    }
+    if ((syscalls().unlinkat(fd, file.c_str(), AT_REMOVEDIR) == -1) && (errno != ENOENT))
+        throw std::system_error(errno, std::system_category(), buildCommittedFileError("rmdir", directory, file, "", errno).c_str());
+}
+
+DirFd::DirFd(const std::string& directory):
+    DirFd(directory, IoStatus(), Checked())
+{
+}
+
+DirFd::DirFd(const std::string& directory, IoStatus&& status, Checked):
+    DirFd(directory, status)
+{
+    status.check();
+}
+
+DirFd::DirFd(const std::string& directory, IoStatus& status):
+    BaseFd(directory,
+           NO_FILE,
+           syscalls().openat(AT_FDCWD, directory.c_str(), O_RDONLY | O_CLOEXEC, 0))
+{
+    status = (fd == -1) ? IoStatus::fromErrno("open", directory, "", "") : IoStatus();
+}
+
+IoStatus DirFd::tryUnlink(const std::string& file)
+{
+    if ((syscalls().unlinkat(fd, file.c_str(), 0) == -1) && (errno != ENOENT))
+        return IoStatus::fromErrno("unlink", directory, file, "");
+    return IoStatus();
+}
+
+void DirFd::unlink(const std::string& file)
+{
+    tryUnlink(file).check();
+}
+
+IoStatus DirFd::tryRenameFile(const std::string& oldFile, const std::string& newFile)
+{
+    if (syscalls().renameat(fd,
+                            oldFile.c_str(),
+                            fd,
+                            newFile.c_str(),
+                            0) == -1)
+        return IoStatus::fromErrno("rename", directory, oldFile, newFile);
+    return IoStatus();
+}
+
+void DirFd::renameFile(const std::string& oldFile, const std::string& newFile)
+{
+    tryRenameFile(oldFile, newFile).check();
+}
+
+IoResult<bool> DirFd::tryExchangeFiles(const std::string& file1, const std::string& file2)
+{
+    if (syscalls().renameat(fd,
+                            file1.c_str(),
+                            fd,
+                            file2.c_str(),
+                            RENAME_EXCHANGE) == -1)
+    {
+        if (errno == ENOENT)
+            return false;
+        /**
+         * EINVAL means that the filesystem does not support
+         * RENAME_EXCHANGE. There is no atomic fallback, so let the
+         * caller know.
+         */
+        return IoStatus::fromErrno("renameat2", directory, file1, file2);
+    }
+    return true;
+}
+
+bool DirFd::exchangeFiles(const std::string& file1, const std::string& file2)
+{
+    return tryExchangeFiles(file1, file2).take();
+}
+
+WriteFd::WriteFd(DirFd& dirFd, const std::string& file):
+    WriteFd(dirFd, file, IoStatus(), Checked())
+{
+}
+
+WriteFd::WriteFd(DirFd& dirFd, const std::string& file, IoStatus&& status, Checked):
+    WriteFd(dirFd, file, status)
+{
+    status.check();
+}
+
+WriteFd::WriteFd(DirFd& dirFd, const std::string& file, IoStatus& status):
+    BaseFd(dirFd.directory,
+           file,
+           syscalls().openat(dirFd,
+                             file.c_str(),
+                             O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                             S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH))
+{
+    status = (fd == -1) ? IoStatus::fromErrno("open", directory, file, "") : IoStatus();
+}
+
+IoStatus WriteFd::tryWriteAll(const void* data, size_t size)
+{
+    if (!writeFully(fd, data, size))
+        /**
+         * ENOSPC and EDQUOT could be recovered by retrying later, see
+         * IoError::retryable().
+         */
+        return IoStatus::fromErrno("write", directory, file, "");
+    return IoStatus();
+}
+
+void WriteFd::writeAll(const void* data, size_t size)
+{
+    tryWriteAll(data, size).check();
+}
+
+CommittedFile::CommittedFile(const std::string& filePath,
+                             const CommitOptions& options):
+    id(PathTable::instance().intern(filePath)),
+    options(options)
+{
+    if (options.createDirectories)
+        ensureDirectory(PathTable::instance().directory(id));
+    removeStaleWorkFiles(id);
+}
+
+CommittedFile::~CommittedFile()
+{
+}
+
+IoStatus CommittedFile::tryWrite(const std::string& data)
+{
+    auto& table(PathTable::instance());
+    const auto& directory(table.directory(id));
+    const char* fileName(table.entry(id).name);
+    FSYNCTEST_PROBE3(commit__begin, directory.c_str(), fileName, static_cast<unsigned long>(data.size()));
+    for (auto observer: commitObservers())
+        observer->commitBegin(id, data.size());
+    IoStatus status(commit(data));
+    FSYNCTEST_PROBE4(commit__end, directory.c_str(), fileName,
+                     static_cast<unsigned long>(data.size()), status.ok() ? 0 : status.error().error);
+    for (auto observer: commitObservers())
+        observer->commitEnd(id, status.ok() ? 0 : status.error().error);
+    return status;
+}
+
+void CommittedFile::write(const std::string& data)
+{
+    tryWrite(data).check();
+}
+
+IoStatus CommittedFile::commit(const std::string& data)
+{
+    auto& table(PathTable::instance());
+    auto& entry(table.entry(id));
+    const auto& directory(table.directory(id));
+    const char* fileName(entry.name);
+    const uint32_t sequence(++entry.started);
+    CommitPhaseScope openPhase(id, directory, fileName, CommitPhase::OPEN);
+    ScopedFd dirFd(syscalls().openat(AT_FDCWD, directory.c_str(), O_RDONLY | O_CLOEXEC, 0));
+    if (dirFd == -1)
+        return IoStatus::fromErrno("open", directory, "", "");
+    /*
+     * First write and sync work-file. Do not touch real-file.
+     */
+    char workFileName[NAME_MAX + 64];
+    if (!formatWorkFileName(workFileName, sizeof(workFileName), fileName, sequence))
+        return IoStatus::failure("open", directory, fileName, "", ENAMETOOLONG);
+    ScopedFd workFileFd(syscalls().openat(dirFd,
+                                          workFileName,
+                                          O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                                          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    if (workFileFd == -1)
+        return IoStatus::fromErrno("open", directory, workFileName, "");
+    openPhase.end();
+    {
+        CommitPhaseScope writePhase(id, directory, fileName, CommitPhase::WRITE);
+        if (!writeFully(workFileFd, data.data(), data.size()))
+            return IoStatus::fromErrno("write", directory, workFileName, "");
+    }
+    DurabilityEpoch::FdReservation fdReservation(options.durability == Durability::DEFERRED);
+    if (!fdReservation.held())
+    {
+        CommitPhaseScope syncPhase(id, directory, fileName, CommitPhase::SYNC);
+        if (syscalls().fsync(workFileFd) == -1)
+            return IoStatus::fromErrno("fsync", directory, workFileName, "");
+    }
+    /**
+     * With Durability::DEFERRED the barrier flushes the data through
+     * workFileFd
+     */
+    if (!fdReservation.held() && (workFileFd.close() == -1))
+        return IoStatus::fromErrno("close", directory, workFileName, "");
+    {
+        CommitPhaseScope renamePhase(id, directory, fileName, CommitPhase::RENAME);
+        DurabilityEpoch::PublishGuard publishGuard(options.durability == Durability::DEFERRED);
+        std::lock_guard<std::mutex> lock(table.publishMutex(id));
+        if (PathTable::isNewer(entry.published, sequence))
+        {
+            /**
+             * A newer version is already in place. Its data is synced,
+             * so flushing the directory below is all that is left to do.
+             */
+            for (auto observer: commitObservers())
+                observer->commitElided(id);
+            if ((syscalls().unlinkat(dirFd, workFileName, 0) == -1) && (errno != ENOENT))
+                return IoStatus::fromErrno("unlink", directory, workFileName, "");
+        }
+        else if (options.mode == CommitMode::KEEP_PREVIOUS)
+        {
+            /**
+             * The exchange publishes the new version and moves the old
+             * one to work-file in a single atomic operation, so the real
+             * file is always either the old or the new version. Renaming
+             * the old one to <name>.prev is covered by the same directory
+             * fsync. If we crash in between, <name>.prev still holds an
+             * older published version and the stale work-file is removed
+             * by removeStaleWorkFiles(). <name>.prev never holds data
+             * that was not published.
+             */
+            if (syscalls().renameat(dirFd, workFileName, dirFd, fileName, RENAME_EXCHANGE) == 0)
+            {
+                char prevFileName[NAME_MAX + 64];
+                snprintf(prevFileName, sizeof(prevFileName), "%s.prev", fileName);
+                if (syscalls().renameat(dirFd, workFileName, dirFd, prevFileName, 0) == -1)
+                    return IoStatus::fromErrno("rename", directory, workFileName, prevFileName);
+            }
+            else if (errno != ENOENT)
+            {
+                /**
+                 * EINVAL means that the filesystem does not support
+                 * RENAME_EXCHANGE. Nothing was published, so do not leave
+                 * the work-file behind.
+                 */
+                const auto status(IoStatus::fromErrno("renameat2", directory, workFileName, fileName));
+                syscalls().unlinkat(dirFd, workFileName, 0);
+                return status;
+            }
+            else if (syscalls().renameat(dirFd, workFileName, dirFd, fileName, 0) == -1)
+                /**
+                 * First version, nothing to keep
+                 */
+                return IoStatus::fromErrno("rename", directory, workFileName, fileName);
+        }
+        /**
+         * Posix guarantees that rename is atomic...
+         */
+        else if (syscalls().renameat(dirFd, workFileName, dirFd, fileName, 0) == -1)
+            return IoStatus::fromErrno("rename", directory, workFileName, fileName);
+        if (PathTable::isNewer(sequence, entry.published))
+        {
+            entry.published = sequence;
+            if (options.durability == Durability::DEFERRED)
+                DurabilityEpoch::instance().markDirty(id, fdReservation, workFileFd, options.mode == CommitMode::KEEP_PREVIOUS);
+        }
+    }
+    if (options.durability == Durability::DEFERRED)
+    {
+        /**
+         * Data and directory are flushed by the next barrier
+         */
+        if (dirFd.close() == -1)
+            return IoStatus::fromErrno("close", directory, "", "");
+        return IoStatus();
+    }
+    /**
+     * ... and with a directory fsync data is actually stored on disk
+     * See: https://lwn.net/Articles/457667/
+     */
+    CommitPhaseScope dirSyncPhase(id, directory, fileName, CommitPhase::DIRECTORY_SYNC);
+    if (options.durability == Durability::GROUPED)
+    {
+        if (dirFd.close() == -1)
+            return IoStatus::fromErrno("close", directory, "", "");
+        return GroupCommitter::instance().trySyncDirectory(directory);
+    }
+    if (syscalls().fsync(dirFd) == -1)
+        return IoStatus::fromErrno("fsync", directory, "", "");
+    if (dirFd.close() == -1)
+        return IoStatus::fromErrno("close", directory, "", "");
+    return IoStatus();
+}
+
+void CommittedFile::rollback()
+{
+    auto& table(PathTable::instance());
+    DirFd dirFd(table.directory(id));
+    const std::string fileName(table.entry(id).name);
+    const auto prevFileName(fileName + ".prev");
+    /**
+     * Not in the middle of a KEEP_PREVIOUS commit of the same path
+     */
+    std::lock_guard<std::mutex> lock(table.publishMutex(id));
+    if (!dirFd.exchangeFiles(prevFileName, fileName))
+        throw std::system_error(ENOENT, std::system_category(), buildCommittedFileError("rollback", dirFd.directory, prevFileName, fileName, ENOENT).c_str());
+    dirFd.sync();
+    dirFd.close();
+}
+
+IoResult<std::string> CommittedFile::tryRead() const
+{
+    for (auto observer: commitObservers())
+        observer->readBegin(id);
+    return tryReadFile(getPath());
+}
+
+std::string CommittedFile::read() const
+{
+    return tryRead().take();
+}
+
+namespace
+{
+    /**
+     * Pid of a <name>.work.<pid>.<sequence> file name, 0 if it is none
+     */
+    pid_t workFilePid(const std::string& name)
+    {
+        const auto sequenceDot(name.rfind('.'));
+        if ((sequenceDot == std::string::npos) || (sequenceDot + 1 == name.size()) ||
+            (name.find_first_not_of("0123456789", sequenceDot + 1) != std::string::npos))
+            return 0;
+        const auto pidDot(name.rfind('.', sequenceDot - 1));
+        if ((pidDot == std::string::npos) || (pidDot + 1 == sequenceDot) || (pidDot < 5) ||
+            (name.compare(pidDot - 5, 5, ".work") != 0))
+            return 0;
+        const auto pid(name.substr(pidDot + 1, sequenceDot - pidDot - 1));
+        if ((pid.size() > 9) || (pid.find_first_not_of("0123456789") != std::string::npos))
+            return 0;
+        return static_cast<pid_t>(std::stol(pid));
+    }
+
+    void removeStaleWorkFiles(PathId id)
+    {
+        auto& table(PathTable::instance());
+        DirFd dirFd(table.directory(id));
+        const std::string fileName(table.entry(id).name);
+        FSYNCTEST_PROBE2(cleanup__begin, dirFd.directory.c_str(), fileName.c_str());
+        dirFd.unlink(fileName + ".work");
+        unsigned long removed(0);
+        /**
+         * Listing is linear in the size of the directory, so it is not
+         * repeated for every handle
+         */
+        if (table.claimDirectoryScan(id))
+            for (const auto& entry: dirFd.list())
+            {
+                if (entry.second)
+                    continue;
+                const pid_t pid(workFilePid(entry.first));
+                if ((pid > 0) && (pid != getpid()) && (kill(pid, 0) == -1) && (errno == ESRCH))
+                {
+                    dirFd.unlink(entry.first);
+                    ++removed;
+                }
+            }
+        dirFd.close();
+        FSYNCTEST_PROBE3(cleanup__end, dirFd.directory.c_str(), fileName.c_str(), removed);
+    }
+}
+
+std::string CommittedFile::getPath() const
+{
+    return PathTable::instance().path(id);
+}
+
+PathTable& PathTable::instance()
+{
+    static PathTable table;
+    return table;
+}
+
+bool PathTable::claimDirectoryScan(PathId id)
+{
+    std::lock_guard<std::mutex> lock(directoriesMutex);
+    return scannedDirectories.insert(entries[id].directory).second;
+}
+
+uint32_t PathTable::internDirectory(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(directoriesMutex);
+    const auto found(directoryIds.find(directory));
+    if (found != directoryIds.end())
+        return found->second;
+    const uint32_t id(directories.append());
+    directories[id] = directory;
+    directoryIds.emplace(directory, id);
+    return id;
+}
+
+PathId PathTable::intern(const std::string& filePath)
+{
+    const uint32_t directory(internDirectory(dirName(filePath)));
+    const auto name(baseName(filePath));
+    const size_t hash(std::hash<std::string>()(name) ^ (directory * 0x9e3779b97f4a7c15ull));
+    auto& shard(shards[hash % SHARDS]);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto range(shard.ids.equal_range(hash));
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        const auto& entry(entries[it->second]);
+        if ((entry.directory == directory) && (name == entry.name))
+            return it->second;
+    }
+    const PathId id(entries.append());
+    auto& entry(entries[id]);
+    entry.directory = directory;
+    entry.name = storeName(name);
+    shard.ids.emplace(hash, id);
+    return id;
+}
+
+const char* PathTable::storeName(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(namesMutex);
+    const size_t size(name.size() + 1);
+    if (size > NAME_BLOCK_SIZE)
+    {
+        /**
+         * Cannot happen for a single path component, but be safe
+         */
+        nameBlocks.emplace_back(new char[size]);
+        nameBlockUsed = NAME_BLOCK_SIZE;
+        memcpy(nameBlocks.back().get(), name.c_str(), size);
+        return nameBlocks.back().get();
+    }
+    if (NAME_BLOCK_SIZE - nameBlockUsed < size)
+    {
+        nameBlocks.emplace_back(new char[NAME_BLOCK_SIZE]);
+        nameBlockUsed = 0;
+    }
+    char* stored(nameBlocks.back().get() + nameBlockUsed);
+    memcpy(stored, name.c_str(), size);
+    nameBlockUsed += size;
+    return stored;
+}
+
+std::string PathTable::path(PathId id)
+{
+    const auto& entry(entries[id]);
+    const auto& directory(directories[entry.directory]);
+    if (directory == "/")
+        return directory + entry.name;
+    return directory + '/' + entry.name;
+}
+
+DurableDirectories& DurableDirectories::instance()
+{
+    static DurableDirectories directories;
+    return directories;
+}
+
+IoStatus DurableDirectories::ensure(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (known.count(directory))
+        return IoStatus();
+
+    /**
+     * Walk up to the closest directory that exists
+     */
+    std::vector<std::string> missing;
+    std::string existing(directory);
+    while (!known.count(existing))
+    {
+        ScopedFd fd(syscalls().openat(AT_FDCWD, existing.c_str(), O_RDONLY | O_CLOEXEC, 0));
+        if (fd != -1)
+            break;
+        if (errno != ENOENT)
+            return IoStatus::fromErrno("open", existing, "", "");
+        missing.push_back(existing);
+        auto parent(dirName(existing));
+        if (parent == existing)
+            return IoStatus::failure("open", existing, "", "", ENOENT);
+        existing.swap(parent);
+    }
+    known.insert(existing);
+
+    /**
+     * And create the missing ones top down. The entry of each new
+     * directory is made durable by syncing its parent before anything
+     * is created below it.
+     */
+    for (auto it = missing.rbegin(); it != missing.rend(); ++it)
+    {
+        const auto parent(dirName(*it));
+        const auto name(baseName(*it));
+        ScopedFd parentFd(syscalls().openat(AT_FDCWD, parent.c_str(), O_RDONLY | O_CLOEXEC, 0));
+        if (parentFd == -1)
+            return IoStatus::fromErrno("open", parent, "", "");
+        /**
+         * EEXIST means that another process won the race. Its directory
+         * may not be durable yet, so sync the parent anyway.
+         */
+        if ((syscalls().mkdirat(parentFd, name.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) &&
+            (errno != EEXIST))
+            return IoStatus::fromErrno("mkdir", parent, name, "");
+        if (syscalls().fsync(parentFd) == -1)
+            return IoStatus::fromErrno("fsync", parent, "", "");
+        if (parentFd.close() == -1)
+            return IoStatus::fromErrno("close", parent, "", "");
+        known.insert(*it);
+    }
+    return IoStatus();
+}
+
+DurabilityEpoch::DurabilityEpoch():
+    heldFds(0),
+    maxHeldFds(256),
+    epoch(0)
+{
+    pthread_rwlock_init(&publishLock, nullptr);
+    struct rlimit limit;
+    if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur != RLIM_INFINITY))
+        maxHeldFds = static_cast<long>(std::min<rlim_t>(limit.rlim_cur / 4, 65536));
+}
+
+DurabilityEpoch::FdReservation::FdReservation(bool deferred):
+    reserved(false)
+{
+    if (!deferred)
+        return;
+    auto& epoch(DurabilityEpoch::instance());
+    if (++epoch.heldFds <= epoch.maxHeldFds)
+        reserved = true;
+    else
+        --epoch.heldFds;
+}
+
+DurabilityEpoch::FdReservation::~FdReservation()
+{
+    if (reserved)
+        --DurabilityEpoch::instance().heldFds;
+}
+
+void DurabilityEpoch::closeHeld(int fd)
+{
+    if (fd < 0)
+        return;
+    syscalls().close(fd);
+    --heldFds;
+}
+
+DurabilityEpoch::PublishGuard::PublishGuard(bool deferred):
+    deferred(deferred)
+{
+    if (deferred)
+        pthread_rwlock_rdlock(&DurabilityEpoch::instance().publishLock);
+}
+
+DurabilityEpoch::PublishGuard::~PublishGuard()
+{
+    if (deferred)
+        pthread_rwlock_unlock(&DurabilityEpoch::instance().publishLock);
+}
+
+DurabilityEpoch& DurabilityEpoch::instance()
+{
+    static DurabilityEpoch epoch;
+    return epoch;
+}
+
+void DurabilityEpoch::markDirty(PathId id, FdReservation& reservation, ScopedFd& fd, bool keepsPrevious)
+{
+    auto& entry(PathTable::instance().entry(id));
+    const int heldFd(reservation.reserved ? fd.release() : -1);
+    reservation.reserved = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!entry.dirtyIndex)
+    {
+        const DirtyFile file = { id, heldFd, -1 };
+        dirtyFiles.push_back(file);
+        entry.dirtyIndex = static_cast<uint32_t>(dirtyFiles.size());
+        return;
+    }
+    /**
+     * The version committed earlier in this epoch is no longer the one
+     * in place
+     */
+    auto& file(dirtyFiles[entry.dirtyIndex - 1]);
+    if (keepsPrevious)
+    {
+        closeHeld(file.previousFd);
+        file.previousFd = file.fd;
+    }
+    else
+        closeHeld(file.fd);
+    file.fd = heldFd;
+}
+
+std::vector<DurabilityEpoch::DirtyFile> DurabilityEpoch::takeDirtyFiles()
+{
+    auto& table(PathTable::instance());
+    std::vector<DirtyFile> files;
+    std::lock_guard<std::mutex> lock(mutex);
+    files.swap(dirtyFiles);
+    for (const auto& file: files)
+        table.entry(file.id).dirtyIndex = 0;
+    return files;
+}
+
+void DurabilityEpoch::releaseDirtyFiles(std::vector<DirtyFile>& files)
+{
+    for (const auto& file: files)
+    {
+        closeHeld(file.fd);
+        closeHeld(file.previousFd);
+    }
+    files.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dirtyFiles.empty() && (files.capacity() > dirtyFiles.capacity()))
+        dirtyFiles.swap(files);
+}
+
+unsigned long DurabilityEpoch::barrier(BarrierMethod method)
+{
+    /**
+     * Barriers are serialized so that returning from one means that all
+     * earlier epochs are durable too.
+     */
+    std::lock_guard<std::mutex> barrierLock(barrierMutex);
+    auto& table(PathTable::instance());
+    unsigned long closedEpoch;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closedEpoch = epoch++;
+    }
+    std::vector<DirtyFile> files;
+    std::vector<DirtyFile> lateFiles;
+    struct Release
+    {
+        DurabilityEpoch& epoch;
+        std::vector<DirtyFile>& files;
+        std::vector<DirtyFile>& lateFiles;
+        ~Release()
+        {
+            epoch.releaseDirtyFiles(lateFiles);
+            epoch.releaseDirtyFiles(files);
+        }
+    } release = { *this, files, lateFiles };
+    struct Exclusive
+    {
+        pthread_rwlock_t& lock;
+        ~Exclusive()
+        {
+            pthread_rwlock_unlock(&lock);
+        }
+    };
+
+    if (method == BarrierMethod::SYNCFS)
+    {
+        /**
+         * syncfs() flushes data and directories in one go, so no
+         * deferred rename may run concurrently
+         */
+        pthread_rwlock_wrlock(&publishLock);
+        Exclusive exclusive = { publishLock };
+        files = takeDirtyFiles();
+        std::set<std::string> directories;
+        for (const auto& file: files)
+            directories.insert(table.directory(file.id));
+        std::set<dev_t> synced;
+        for (const auto& directory: directories)
+        {
+            DirFd dirFd(directory);
+            struct stat st;
+            if (syscalls().fstat(dirFd, &st) == -1)
+                throw std::system_error(errno, std::system_category(), buildCommittedFileError("fstat", directory, "", "", errno).c_str());
+            if (synced.insert(st.st_dev).second)
+                dirFd.syncFilesystem();
+            dirFd.close();
+        }
+        return closedEpoch;
+    }
+
+    /**
+     * Flush file data from a few threads so that the device sees a deep
+     * queue instead of one fdatasync at a time.
+     */
+    auto dataSync = [&table](const std::vector<DirtyFile>& work)
+    {
+        std::atomic<size_t> next(0);
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        auto sync = [&table](PathId id, int fd)
+        {
+            if ((fd >= 0) && (syscalls().fdatasync(fd) == -1))
+                throw std::system_error(errno, std::system_category(), buildCommittedFileError("fdatasync", table.directory(id), table.entry(id).name, "", errno).c_str());
+        };
+        auto worker = [&]()
+        {
+            try
+            {
+                for (size_t i = next++; i < work.size(); i = next++)
+                {
+                    sync(work[i].id, work[i].fd);
+                    sync(work[i].id, work[i].previousFd);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        };
+        const size_t threadCount(std::min<size_t>(work.size(), std::max(1u, std::min(16u, std::thread::hardware_concurrency()))));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < threadCount; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& thread: threads)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
+    };
+
+    /**
+     * The bulk of the data is flushed while commits go on
+     */
+    files = takeDirtyFiles();
+    dataSync(files);
+
+    /**
+     * Commits that published since then share the directories and would
+     * be made durable by their fsync, so flush their data too and keep
+     * further deferred renames out until the directories are done.
+     */
+    pthread_rwlock_wrlock(&publishLock);
+    Exclusive exclusive = { publishLock };
+    lateFiles = takeDirtyFiles();
+    dataSync(lateFiles);
+    std::set<std::string> directories;
+    for (const auto& file: files)
+        directories.insert(table.directory(file.id));
+    for (const auto& file: lateFiles)
+        directories.insert(table.directory(file.id));
+    for (const auto& directory: directories)
+    {
+        DirFd dirFd(directory);
+        dirFd.sync();
+        dirFd.close();
+    }
+    return closedEpoch;
+}
+
+namespace
+{
+    const uint32_t INTENT_MAGIC(0x58545346); // "FSTX"
+
+    void putU32(std::string& buffer, uint32_t value)
+    {
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    bool getU32(const std::string& buffer, size_t& offset, uint32_t& value)
+    {
+        if (buffer.size() - offset < sizeof(value))
+            return false;
+        memcpy(&value, buffer.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return true;
+    }
+
+    uint64_t newTransactionId()
+    {
+        static std::mutex mutex;
+        static std::mt19937_64 generator((static_cast<uint64_t>(std::random_device()()) << 32) ^
+                                         static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::lock_guard<std::mutex> lock(mutex);
+        return generator();
+    }
+}
+
+TransactionLog::TransactionLog(const std::string& logPath,
+                               const std::vector<std::string>& directories):
+    logDirFd(dirName(logPath)),
+    logFd(logDirFd.directory,
+          baseName(logPath),
+          syscalls().openat(logDirFd,
+                            baseName(logPath).c_str(),
+                            O_CREAT | O_RDWR | O_CLOEXEC,
+                            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH))
+{
+    if (logFd == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileError("open", logFd.directory, logFd.file, "", errno).c_str());
+    /**
+     * Make sure the log itself survives a crash before anyone relies
+     * on it.
+     */
+    logDirFd.sync();
+    recover();
+    removeOrphans(directories.empty() ? std::vector<std::string>(1, logDirFd.directory) : directories);
+}
+
+std::string TransactionLog::workFileName(const std::string& fileName, uint64_t id)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".txn.%016llx", static_cast<unsigned long long>(id));
+    return fileName + suffix;
+}
+
+bool TransactionLog::isWorkFileName(const std::string& name)
+{
+    static const size_t SUFFIX_SIZE = 21; // ".txn." and 16 hex digits
+    return (name.size() > SUFFIX_SIZE) &&
+        (name.compare(name.size() - SUFFIX_SIZE, 5, ".txn.") == 0) &&
+        (name.find_first_not_of("0123456789abcdef", name.size() - 16) == std::string::npos);
+}
+
+void TransactionLog::removeOrphans(const std::vector<std::string>& directories)
+{
+    /**
+     * recover() has renamed the work-files of the committed transaction,
+     * whatever is left belongs to one that never committed. Removing
+     * them does not need to be durable.
+     */
+    for (const auto& directory: directories)
+    {
+        DirFd dirFd(directory);
+        for (const auto& entry: dirFd.list())
+            if (!entry.second && isWorkFileName(entry.first))
+                dirFd.unlink(entry.first);
+        dirFd.close();
+    }
+}
+
+void TransactionLog::recover()
+{
+    std::string record(readFile(logFd.directory + '/' + logFd.file));
+    size_t offset(0);
+    uint32_t magic(0);
+    uint32_t count(0);
+    uint32_t idLow(0);
+    uint32_t idHigh(0);
+    if (!getU32(record, offset, magic) || (magic != INTENT_MAGIC) ||
+        !getU32(record, offset, count) ||
+        !getU32(record, offset, idLow) ||
+        !getU32(record, offset, idHigh))
+        return;
+
+    std::vector<std::string> filePaths;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t length(0);
+        if (!getU32(record, offset, length) || (record.size() - offset < length))
+            return;
+        filePaths.emplace_back(record, offset, length);
+        offset += length;
+    }
+    const size_t checked(offset);
+    uint32_t checksum(0);
+    if (!getU32(record, offset, checksum) || (checksum != crc32(record.data(), checked)))
+        /**
+         * Torn record, the transaction never committed
+         */
+        return;
+
+    finish((static_cast<uint64_t>(idHigh) << 32) | idLow, filePaths);
+    logFd.dataSync();
+}
+
+void TransactionLog::commit(uint64_t id, const std::vector<std::string>& filePaths)
+{
+    std::string record;
+    putU32(record, INTENT_MAGIC);
+    putU32(record, static_cast<uint32_t>(filePaths.size()));
+    putU32(record, static_cast<uint32_t>(id));
+    putU32(record, static_cast<uint32_t>(id >> 32));
+    for (const auto& filePath: filePaths)
+    {
+        putU32(record, static_cast<uint32_t>(filePath.size()));
+        record += filePath;
+    }
+    putU32(record, crc32(record.data(), record.size()));
+
+    /**
+     * Recovery takes a missing work-file for one that was renamed
+     * already, so their directory entries must be durable before the
+     * intent is.
+     */
+    std::set<std::string> directories;
+    for (const auto& filePath: filePaths)
+        directories.insert(dirName(filePath));
+    for (const auto& directory: directories)
+    {
+        DirFd dirFd(directory);
+        dirFd.sync();
+        dirFd.close();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t written(0);
+    while (written < record.size())
+    {
+        const ssize_t ret(syscalls().pwrite(logFd, record.data() + written, record.size() - written, static_cast<off_t>(written)));
+        if (ret < 0)
+            throw std::system_error(errno, std::system_category(), buildCommittedFileError("pwrite", logFd.directory, logFd.file, "", errno).c_str());
+        written += static_cast<size_t>(ret);
+    }
+    /**
+     * This is the commit point of the whole transaction
+     */
+    logFd.dataSync();
+    finish(id, filePaths);
+}
+
+void TransactionLog::finish(uint64_t id, const std::vector<std::string>& filePaths)
+{
+    std::set<std::string> directories;
+    for (const auto& filePath: filePaths)
+    {
+        DirFd dirFd(dirName(filePath));
+        const auto fileName(baseName(filePath));
+        const auto workName(workFileName(fileName, id));
+        if (syscalls().renameat(dirFd, workName.c_str(), dirFd, fileName.c_str(), 0) == -1)
+        {
+            /**
+             * Already renamed before the crash
+             */
+            if (errno != ENOENT)
+                throw std::system_error(errno, std::system_category(), buildCommittedFileError("rename", dirFd.directory, workName, fileName, errno).c_str());
+        }
+        dirFd.close();
+        directories.insert(dirFd.directory);
+    }
+    for (const auto& directory: directories)
+    {
+        DirFd dirFd(directory);
+        dirFd.sync();
+        dirFd.close();
+    }
+    /**
+     * Truncating does not need to be durable. Work-file names are unique
+     * per transaction so replaying a stale record later finds nothing
+     * to rename.
+     */
+    if (syscalls().ftruncate(logFd, 0) == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileError("ftruncate", logFd.directory, logFd.file, "", errno).c_str());
+}
+
+FileTransaction::FileTransaction(TransactionLog& log):
+    log(log),
+    id(newTransactionId()),
+    committed(false)
+{
+}
+
+FileTransaction::~FileTransaction()
+{
+    if (committed)
+        return;
+    for (const auto& filePath: filePaths)
+        /* Ignore errors */
+        syscalls().unlinkat(AT_FDCWD, (dirName(filePath) + '/' + TransactionLog::workFileName(baseName(filePath), id)).c_str(), 0);
+}
+
+void FileTransaction::write(const std::string& filePath, const std::string& data)
+{
+    DirFd dirFd(dirName(filePath));
+    WriteFd workFileFd(dirFd, TransactionLog::workFileName(baseName(filePath), id));
+    filePaths.push_back(filePath);
+    workFileFd.writeAll(data.data(), data.size());
+    workFileFd.dataSync();
+    workFileFd.close();
+    dirFd.close();
+}
+
+void FileTransaction::commit()
+{
+    log.commit(id, filePaths);
+    committed = true;
+}
+
+const std::string SnapshotPublisher::CURRENT("current");
+const std::string SnapshotPublisher::VERSIONS("versions");
+
+namespace
+{
+    bool parseVersion(const std::string& name, unsigned long& version)
+    {
+        if (name.empty() || (name.find_first_not_of("0123456789") != std::string::npos))
+            return false;
+        version = std::stoul(name);
+        return true;
+    }
+
+    std::vector<unsigned long> listVersions(const std::string& versionsDirectory)
+    {
+        std::vector<unsigned long> versions;
+        DirFd versionsFd(versionsDirectory);
+        for (const auto& entry: versionsFd.list())
+        {
+            unsigned long version;
+            if (entry.second && parseVersion(entry.first, version))
+                versions.push_back(version);
+        }
+        versionsFd.close();
+        std::sort(versions.begin(), versions.end());
+        return versions;
+    }
+
+    void checkRelativePath(const std::string& path)
+    {
+        if (path.empty() || (path[0] == '/') ||
+            (path == "..") || (path.compare(0, 3, "../") == 0) ||
+            (path.find("/../") != std::string::npos) ||
+            ((path.size() >= 3) && (path.compare(path.size() - 3, 3, "/..") == 0)))
+            throw std::invalid_argument("Snapshot file path must be relative and stay inside the snapshot: " + path);
+    }
+}
+
+SnapshotPublisher::SnapshotPublisher(const std::string& rootDirectory,
+                                     unsigned keepVersions,
+                                     BarrierMethod method):
+    rootDirectory(rootDirectory),
+    versionsDirectory(rootDirectory + '/' + VERSIONS),
+    keepVersions(std::max(1u, keepVersions)),
+    method(method),
+    lastVersion(0),
+    gcPending(false),
+    stopping(false)
+{
+    DirFd rootFd(rootDirectory);
+    if (rootFd.makeDirectory(VERSIONS))
+        rootFd.sync();
+    rootFd.unlink(CURRENT + ".work");
+    rootFd.close();
+
+    const auto versions(listVersions(versionsDirectory));
+    if (!versions.empty())
+        lastVersion = versions.back();
+
+    gcThread = std::thread(&SnapshotPublisher::collectGarbage, this);
+}
+
+SnapshotPublisher::~SnapshotPublisher()
+{
+    {
+        std::lock_guard<std::mutex> lock(gcMutex);
+        stopping = true;
+    }
+    gcCondition.notify_one();
+    gcThread.join();
+}
+
+unsigned long SnapshotPublisher::publish(const std::vector<std::pair<std::string, std::string>>& files)
+{
+    for (const auto& file: files)
+        checkRelativePath(file.first);
+
+    std::lock_guard<std::mutex> lock(publishMutex);
+    const unsigned long version(lastVersion + 1);
+    const std::string versionName(std::to_string(version));
+    {
+        DirFd versionsFd(versionsDirectory);
+        /**
+         * Leftover from a publish that crashed before switching current
+         */
+        if (!versionsFd.makeDirectory(versionName))
+        {
+            versionsFd.removeTree(versionName);
+            versionsFd.makeDirectory(versionName);
+        }
+        writeVersion(versionsDirectory + '/' + versionName, files);
+        versionsFd.sync();
+        versionsFd.close();
+    }
+    lastVersion = version;
+
+    /**
+     * Same work-name + rename protocol as CommittedFile, only the
+     * payload is a symlink.
+     */
+    DirFd rootFd(rootDirectory);
+    const std::string workName(CURRENT + ".work");
+    rootFd.unlink(workName);
+    rootFd.createSymlink(VERSIONS + '/' + versionName, workName);
+    rootFd.renameFile(workName, CURRENT);
+    rootFd.sync();
+    rootFd.close();
+
+    {
+        std::lock_guard<std::mutex> gcLock(gcMutex);
+        gcPending = true;
+    }
+    gcCondition.notify_one();
+    return version;
+}
+
+void SnapshotPublisher::writeVersion(const std::string& versionDirectory,
+                                     const std::vector<std::pair<std::string, std::string>>& files)
+{
+    /**
+     * std::set keeps parents ahead of their children
+     */
+    std::set<std::string> subDirectories;
+    for (const auto& file: files)
+        for (auto slash = file.first.find('/'); slash != std::string::npos; slash = file.first.find('/', slash + 1))
+            subDirectories.insert(file.first.substr(0, slash));
+    {
+        DirFd versionFd(versionDirectory);
+        for (const auto& subDirectory: subDirectories)
+            versionFd.makeDirectory(subDirectory);
+        versionFd.close();
+    }
+
+    std::atomic<size_t> next(0);
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto worker = [&]()
+    {
+        try
+        {
+            for (size_t i = next++; i < files.size(); i = next++)
+            {
+                const std::string filePath(versionDirectory + '/' + files[i].first);
+                DirFd dirFd(dirName(filePath));
+                WriteFd fileFd(dirFd, baseName(filePath));
+                fileFd.writeAll(files[i].second.data(), files[i].second.size());
+                if (method == BarrierMethod::PER_FILE)
+                    fileFd.dataSync();
+                fileFd.close();
+                dirFd.close();
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+    const size_t threadCount(std::min<size_t>(files.size(), std::max(1u, std::min(16u, std::thread::hardware_concurrency()))));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread: threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    DirFd versionFd(versionDirectory);
+    if (method == BarrierMethod::SYNCFS)
+        versionFd.syncFilesystem();
+    else
+    {
+        for (const auto& subDirectory: subDirectories)
+        {
+            DirFd subDirFd(versionDirectory + '/' + subDirectory);
+            subDirFd.sync();
+            subDirFd.close();
+        }
+        versionFd.sync();
+    }
+    versionFd.close();
+}
+
+void SnapshotPublisher::collectGarbage()
+{
+    std::unique_lock<std::mutex> lock(gcMutex);
+    while (true)
+    {
+        gcCondition.wait(lock, [this]() { return gcPending || stopping; });
+        if (stopping)
+            return;
+        gcPending = false;
+        lock.unlock();
+        try
+        {
+            unsigned long newest;
+            {
+                std::lock_guard<std::mutex> publishLock(publishMutex);
+                newest = lastVersion;
+            }
+            const auto versions(listVersions(versionsDirectory));
+            DirFd versionsFd(versionsDirectory);
+            for (const auto version: versions)
+                /**
+                 * Versions newer than the one we looked at may be in the
+                 * middle of being published
+                 */
+                if (version + keepVersions <= newest)
+                    versionsFd.removeTree(std::to_string(version));
+            versionsFd.close();
+        }
+        catch (const std::exception& e)
+        {
+            /**
+             * Garbage is retried after the next publish
+             */
+            std::cerr << "Snapshot garbage collection failed: " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+uint64_t LatencyHistogram::percentile(double q) const
+{
+    if (total == 0)
+        return 0;
+    const uint64_t rank(std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(total)))));
+    uint64_t seen(0);
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::min(bucketUpperEdge(i), maxValue);
+    }
+    return maxValue;
+}
+
+int PosixSyscallBackend::readDirectory(int dirFd, std::vector<std::pair<std::string, bool>>& entries)
+{
+    /**
+     * The duplicate shares the file offset, hence the rewind
+     */
+    const int listFd(::dup(dirFd));
+    DIR* dir(listFd == -1 ? nullptr : ::fdopendir(listFd));
+    if (dir == nullptr)
+    {
+        const int savedErrno(errno);
+        if (listFd != -1)
+            ::close(listFd);
+        errno = savedErrno;
+        return -1;
+    }
+    ::rewinddir(dir);
+    errno = 0;
+    while (const struct dirent* entry = ::readdir(dir))
+    {
+        const std::string name(entry->d_name);
+        if ((name != ".") && (name != ".."))
+        {
+            bool isDirectory(entry->d_type == DT_DIR);
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                isDirectory = (::fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode);
+            }
+            entries.emplace_back(name, isDirectory);
+        }
+        errno = 0;
+    }
+    const int savedErrno(errno);
+    ::closedir(dir);
+    errno = savedErrno;
+    return savedErrno ? -1 : 0;
+}
+
+MemorySyscallBackend::MemorySyscallBackend():
+    nextFd(1 << 20),
+    nextInode(1)
+{
+    nodes["/"] = Node{ Node::Type::DIRECTORY, nextInode++, nullptr, "" };
+    nodes["."] = Node{ Node::Type::DIRECTORY, nextInode++, nullptr, "" };
+}
+
+std::string MemorySyscallBackend::normalize(const std::string& path)
+{
+    std::vector<std::string> components;
+    size_t start(0);
+    while (start <= path.size())
+    {
+        auto end(path.find('/', start));
+        if (end == std::string::npos)
+            end = path.size();
+        const std::string component(path, start, end - start);
+        if (component == "..")
+        {
+            if (!components.empty())
+                components.pop_back();
+        }
+        else if (!component.empty() && (component != "."))
+            components.push_back(component);
+        start = end + 1;
+    }
+    const bool absolute(!path.empty() && (path[0] == '/'));
+    std::string normalized(absolute ? "/" : "");
+    for (const auto& component: components)
+    {
+        if (!normalized.empty() && (normalized != "/"))
+            normalized += '/';
+        normalized += component;
+    }
+    return normalized.empty() ? "." : normalized;
+}
+
+std::string MemorySyscallBackend::parentOf(const std::string& path)
+{
+    const auto slash(path.rfind('/'));
+    if (slash == std::string::npos)
+        return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+bool MemorySyscallBackend::resolve(int dirFd, const char* path, bool followLast, std::string& resolved) const
+{
+    std::string joined(path);
+    if (joined.empty())
+    {
+        errno = ENOENT;
+        return false;
+    }
+    if ((joined[0] != '/') && (dirFd != AT_FDCWD))
+    {
+        const auto file(files.find(dirFd));
+        if (file == files.end())
+        {
+            errno = EBADF;
+            return false;
+        }
+        if (!file->second.directory)
+        {
+            errno = ENOTDIR;
+            return false;
+        }
+        joined = file->second.path + '/' + joined;
+    }
+
+    /**
+     * Substitute symlinks component by component
+     */
+    for (int loops = 0; loops < 40; ++loops)
+    {
+        const auto normalized(normalize(joined));
+        bool substituted(false);
+        size_t end(normalized[0] == '/' ? 1 : 0);
+        while (!substituted && (end < normalized.size()))
+        {
+            end = normalized.find('/', end + 1);
+            if (end == std::string::npos)
+                end = normalized.size();
+            const std::string prefix(normalized, 0, end);
+            const auto node(nodes.find(prefix));
+            if ((node == nodes.end()) || (node->second.type != Node::Type::SYMLINK))
+                continue;
+            if ((end == normalized.size()) && !followLast)
+                break;
+            const auto& target(node->second.target);
+            joined = ((target[0] == '/') ? target : parentOf(prefix) + '/' + target) + normalized.substr(end);
+            substituted = true;
+        }
+        if (!substituted)
+        {
+            resolved = normalized;
+            return true;
+        }
+    }
+    errno = ELOOP;
+    return false;
+}
+
+bool MemorySyscallBackend::hasChildren(const std::string& path) const
+{
+    if ((path == ".") || (path == "/"))
+    {
+        for (const auto& node: nodes)
+            if ((node.first != path) && (parentOf(node.first) == path))
+                return true;
+        return false;
+    }
+    const auto next(nodes.upper_bound(path + '/'));
+    const auto prefix(path + '/');
+    return (next != nodes.end()) && (next->first.compare(0, prefix.size(), prefix) == 0);
+}
+
+void MemorySyscallBackend::move(const std::string& from, const std::string& to)
+{
+    std::vector<std::pair<std::string, Node>> moved;
+    const auto prefix(from + '/');
+    moved.emplace_back(to, nodes[from]);
+    nodes.erase(from);
+    for (auto node = nodes.lower_bound(prefix); (node != nodes.end()) && (node->first.compare(0, prefix.size(), prefix) == 0);)
+    {
+        moved.emplace_back(to + node->first.substr(from.size()), node->second);
+        node = nodes.erase(node);
+    }
+    for (auto& node: moved)
+        nodes[node.first] = node.second;
+}
+
+void MemorySyscallBackend::createDirectories(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto normalized(normalize(path));
+    size_t end(normalized[0] == '/' ? 1 : 0);
+    while (end < normalized.size())
+    {
+        end = normalized.find('/', end + 1);
+        if (end == std::string::npos)
+            end = normalized.size();
+        const std::string prefix(normalized, 0, end);
+        if (nodes.find(prefix) == nodes.end())
+            nodes[prefix] = Node{ Node::Type::DIRECTORY, nextInode++, nullptr, "" };
+    }
+}
+
+int MemorySyscallBackend::checkFd(int fd)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.count(fd) ? 0 : fail(EBADF);
+}
+
+int MemorySyscallBackend::openat(int dirFd, const char* path, int flags, mode_t)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string resolved;
+    if (!resolve(dirFd, path, !(flags & O_NOFOLLOW), resolved))
+        return -1;
+    auto node(nodes.find(resolved));
+    if (node == nodes.end())
+    {
+        if (!(flags & O_CREAT))
+            return fail(ENOENT);
+        const auto parent(nodes.find(parentOf(resolved)));
+        if (parent == nodes.end())
+            return fail(ENOENT);
+        if (parent->second.type != Node::Type::DIRECTORY)
+            return fail(ENOTDIR);
+        node = nodes.emplace(resolved, Node{ Node::Type::FILE, nextInode++, std::make_shared<std::string>(), "" }).first;
+    }
+    else
+    {
+        if ((flags & O_CREAT) && (flags & O_EXCL))
+            return fail(EEXIST);
+        if (node->second.type == Node::Type::SYMLINK)
+            return fail(ELOOP);
+        const bool directory(node->second.type == Node::Type::DIRECTORY);
+        if (directory && ((flags & O_ACCMODE) != O_RDONLY))
+            return fail(EISDIR);
+        if (!directory && (flags & O_DIRECTORY))
+            return fail(ENOTDIR);
+        if (!directory && (flags & O_TRUNC))
+            node->second.data->clear();
+    }
+    const bool directory(node->second.type == Node::Type::DIRECTORY);
+    const int fd(nextFd++);
+    files[fd] = OpenFile{ resolved, node->second.inode, directory, node->second.data, 0 };
+    return fd;
+}
+
+int MemorySyscallBackend::close(int fd)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.erase(fd) ? 0 : fail(EBADF);
+}
+
+ssize_t MemorySyscallBackend::read(int fd, void* buffer, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(fd));
+    if (file == files.end())
+        return fail(EBADF);
+    if (file->second.directory)
+        return fail(EISDIR);
+    const auto& data(*file->second.data);
+    const size_t position(static_cast<size_t>(file->second.position));
+    if (position >= data.size())
+        return 0;
+    const size_t len(std::min(size, data.size() - position));
+    memcpy(buffer, data.data() + position, len);
+    file->second.position += static_cast<off_t>(len);
+    return static_cast<ssize_t>(len);
+}
+
+ssize_t MemorySyscallBackend::write(int fd, const void* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(fd));
+    if (file == files.end())
+        return fail(EBADF);
+    if (file->second.directory)
+        return fail(EISDIR);
+    auto& contents(*file->second.data);
+    const size_t position(static_cast<size_t>(file->second.position));
+    if (contents.size() < position + size)
+        contents.resize(position + size);
+    memcpy(&contents[position], data, size);
+    file->second.position += static_cast<off_t>(size);
+    return static_cast<ssize_t>(size);
+}
+
+ssize_t MemorySyscallBackend::pwrite(int fd, const void* data, size_t size, off_t offset)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(fd));
+    if (file == files.end())
+        return fail(EBADF);
+    if (file->second.directory)
+        return fail(EISDIR);
+    if (offset < 0)
+        return fail(EINVAL);
+    auto& contents(*file->second.data);
+    const size_t position(static_cast<size_t>(offset));
+    if (contents.size() < position + size)
+        contents.resize(position + size);
+    memcpy(&contents[position], data, size);
+    return static_cast<ssize_t>(size);
+}
+
+off_t MemorySyscallBackend::lseek(int fd, off_t offset, int whence)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(fd));
+    if (file == files.end())
+        return fail(EBADF);
+    off_t base(0);
+    if (whence == SEEK_CUR)
+        base = file->second.position;
+    else if (whence == SEEK_END)
+        base = file->second.data ? static_cast<off_t>(file->second.data->size()) : 0;
+    else if (whence != SEEK_SET)
+        return fail(EINVAL);
+    if (base + offset < 0)
+        return fail(EINVAL);
+    file->second.position = base + offset;
+    return file->second.position;
+}
+
+int MemorySyscallBackend::ftruncate(int fd, off_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(fd));
+    if (file == files.end())
+        return fail(EBADF);
+    if (file->second.directory || (length < 0))
+        return fail(EINVAL);
+    file->second.data->resize(static_cast<size_t>(length));
+    return 0;
+}
+
+int MemorySyscallBackend::fstat(int fd, struct stat* st)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(fd));
+    if (file == files.end())
+        return fail(EBADF);
+    memset(st, 0, sizeof(*st));
+    st->st_dev = 1;
+    st->st_ino = file->second.inode;
+    st->st_nlink = 1;
+    st->st_mode = file->second.directory ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+    st->st_size = file->second.data ? static_cast<off_t>(file->second.data->size()) : 0;
+    return 0;
+}
+
+int MemorySyscallBackend::renameat(int oldDirFd, const char* oldPath, int newDirFd, const char* newPath, unsigned int flags)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string from;
+    std::string to;
+    if (!resolve(oldDirFd, oldPath, false, from) || !resolve(newDirFd, newPath, false, to))
+        return -1;
+    const auto source(nodes.find(from));
+    if (source == nodes.end())
+        return fail(ENOENT);
+    const auto destinationParent(nodes.find(parentOf(to)));
+    if (destinationParent == nodes.end())
+        return fail(ENOENT);
+    if (from == to)
+        return 0;
+    const auto destination(nodes.find(to));
+    if (flags & RENAME_EXCHANGE)
+    {
+        if (destination == nodes.end())
+            return fail(ENOENT);
+        const std::string parked(from + "/\x01exchange");
+        move(from, parked);
+        move(to, from);
+        move(parked, to);
+        return 0;
+    }
+    if (destination != nodes.end())
+    {
+        if (flags & RENAME_NOREPLACE)
+            return fail(EEXIST);
+        const bool sourceIsDirectory(source->second.type == Node::Type::DIRECTORY);
+        const bool destinationIsDirectory(destination->second.type == Node::Type::DIRECTORY);
+        if (destinationIsDirectory && !sourceIsDirectory)
+            return fail(EISDIR);
+        if (!destinationIsDirectory && sourceIsDirectory)
+            return fail(ENOTDIR);
+        if (destinationIsDirectory && hasChildren(to))
+            return fail(ENOTEMPTY);
+        nodes.erase(destination);
+    }
+    move(from, to);
+    return 0;
+}
+
+int MemorySyscallBackend::unlinkat(int dirFd, const char* path, int flags)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string resolved;
+    if (!resolve(dirFd, path, false, resolved))
+        return -1;
+    const auto node(nodes.find(resolved));
+    if (node == nodes.end())
+        return fail(ENOENT);
+    const bool directory(node->second.type == Node::Type::DIRECTORY);
+    if (flags & AT_REMOVEDIR)
+    {
+        if (!directory)
+            return fail(ENOTDIR);
+        if ((resolved == "/") || (resolved == "."))
+            return fail(EBUSY);
+        if (hasChildren(resolved))
+            return fail(ENOTEMPTY);
+    }
+    else if (directory)
+        return fail(EISDIR);
+    nodes.erase(node);
+    return 0;
+}
+
+int MemorySyscallBackend::mkdirat(int dirFd, const char* path, mode_t)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string resolved;
+    if (!resolve(dirFd, path, false, resolved))
+        return -1;
+    if (nodes.count(resolved))
+        return fail(EEXIST);
+    const auto parent(nodes.find(parentOf(resolved)));
+    if (parent == nodes.end())
+        return fail(ENOENT);
+    if (parent->second.type != Node::Type::DIRECTORY)
+        return fail(ENOTDIR);
+    nodes[resolved] = Node{ Node::Type::DIRECTORY, nextInode++, nullptr, "" };
+    return 0;
+}
+
+int MemorySyscallBackend::symlinkat(const char* target, int dirFd, const char* path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string resolved;
+    if (!resolve(dirFd, path, false, resolved))
+        return -1;
+    if (nodes.count(resolved))
+        return fail(EEXIST);
+    if (!nodes.count(parentOf(resolved)))
+        return fail(ENOENT);
+    nodes[resolved] = Node{ Node::Type::SYMLINK, nextInode++, nullptr, target };
+    return 0;
+}
+
+int MemorySyscallBackend::readDirectory(int dirFd, std::vector<std::pair<std::string, bool>>& entries)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto file(files.find(dirFd));
+    if (file == files.end())
+        return fail(EBADF);
+    if (!file->second.directory)
+        return fail(ENOTDIR);
+    const auto& path(file->second.path);
+    for (const auto& node: nodes)
+        if ((node.first != path) && (node.first != "/") && (node.first != ".") && (parentOf(node.first) == path))
+            entries.emplace_back(node.first.substr(path == "." ? 0 : (path == "/" ? 1 : path.size() + 1)),
+                                 node.second.type == Node::Type::DIRECTORY);
+    return 0;
+}
+
+LatencyDistribution::LatencyDistribution():
+    kind(Kind::NONE),
+    first(0),
+    second(0)
+{
+}
+
+namespace
+{
+    /**
+     * Returns microseconds
+     */
+    double parseDuration(const std::string& text)
+    {
+        size_t used(0);
+        double value(0);
+        try
+        {
+            value = std::stod(text, &used);
+        }
+        catch (const std::exception&)
+        {
+            throw std::invalid_argument("Invalid duration: " + text);
+        }
+        const std::string unit(text.substr(used));
+        if (unit.empty() || (unit == "us"))
+            return value;
+        if (unit == "ms")
+            return value * 1000;
+        if (unit == "s")
+            return value * 1000000;
+        throw std::invalid_argument("Invalid duration unit: " + text);
+    }
+
+    double parseSize(const std::string& text)
+    {
+        size_t used(0);
+        double value(0);
+        try
+        {
+            value = std::stod(text, &used);
+        }
+        catch (const std::exception&)
+        {
+            throw std::invalid_argument("Invalid size: " + text);
+        }
+        const std::string unit(text.substr(used));
+        if (unit.empty() || (unit == "b"))
+            return value;
+        if ((unit == "k") || (unit == "K"))
+            return value * 1024;
+        if ((unit == "m") || (unit == "M"))
+            return value * 1024 * 1024;
+        if ((unit == "g") || (unit == "G"))
+            return value * 1024 * 1024 * 1024;
+        throw std::invalid_argument("Invalid size unit: " + text);
+    }
+
+    std::vector<std::string> splitString(const std::string& text, char separator)
+    {
+        std::vector<std::string> parts;
+        size_t start(0);
+        while (true)
+        {
+            const auto end(text.find(separator, start));
+            parts.push_back(text.substr(start, end == std::string::npos ? std::string::npos : end - start));
+            if (end == std::string::npos)
+                return parts;
+            start = end + 1;
+        }
+    }
+}
+
+LatencyDistribution LatencyDistribution::parse(const std::string& spec)
+{
+    return parse(spec, &parseDuration);
+}
+
+LatencyDistribution LatencyDistribution::parse(const std::string& spec, double (*parseValue)(const std::string&))
+{
+    const auto parts(splitString(spec, ':'));
+    LatencyDistribution distribution;
+    if ((parts[0] == "fixed") && (parts.size() == 2))
+    {
+        distribution.kind = Kind::FIXED;
+        distribution.first = parseValue(parts[1]);
+    }
+    else if ((parts[0] == "uniform") && (parts.size() == 3))
+    {
+        distribution.kind = Kind::UNIFORM;
+        distribution.first = parseValue(parts[1]);
+        distribution.second = parseValue(parts[2]);
+        if (distribution.second < distribution.first)
+            throw std::invalid_argument("Empty range: " + spec);
+    }
+    else if ((parts[0] == "exp") && (parts.size() == 2))
+    {
+        distribution.kind = Kind::EXPONENTIAL;
+        distribution.first = parseValue(parts[1]);
+    }
+    else if ((parts[0] == "lognormal") && (parts.size() == 3))
+    {
+        distribution.kind = Kind::LOGNORMAL;
+        distribution.first = parseValue(parts[1]);
+        distribution.second = std::stod(parts[2]);
+    }
+    else
+        throw std::invalid_argument("Invalid distribution: " + spec);
+    if ((distribution.first < 0) || (distribution.second < 0))
+        throw std::invalid_argument("Negative value: " + spec);
+    return distribution;
+}
+
+std::chrono::nanoseconds LatencyDistribution::sample(std::mt19937_64& generator) const
+{
+    return std::chrono::nanoseconds(static_cast<long long>(sampleValue(generator) * 1000));
+}
+
+double LatencyDistribution::sampleValue(std::mt19937_64& generator) const
+{
+    switch (kind)
+    {
+    case Kind::NONE:
+        break;
+    case Kind::FIXED:
+        return first;
+    case Kind::UNIFORM:
+        return std::uniform_real_distribution<double>(first, second)(generator);
+    case Kind::EXPONENTIAL:
+        if (first > 0)
+            return std::exponential_distribution<double>(1.0 / first)(generator);
+        break;
+    case Kind::LOGNORMAL:
+        if (first > 0)
+            return std::lognormal_distribution<double>(std::log(first), second)(generator);
+        break;
+    }
+    return 0;
+}
+
+LatencyInjectingSyscallBackend::LatencyInjectingSyscallBackend(SyscallBackend& next, uint64_t seed):
+    next(next),
+    generator(seed)
+{
+}
+
+void LatencyInjectingSyscallBackend::setLatency(SyscallClass syscallClass, const LatencyDistribution& distribution)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    latencies[static_cast<size_t>(syscallClass)] = distribution;
+}
+
+void LatencyInjectingSyscallBackend::setLatency(const std::string& spec)
+{
+    static const char* const NAMES[] = { "open", "close", "read", "write", "sync", "rename", "unlink", "mkdir" };
+    const auto equals(spec.find('='));
+    if (equals != std::string::npos)
+        for (size_t i = 0; i < static_cast<size_t>(SyscallClass::COUNT); ++i)
+            if (spec.compare(0, equals, NAMES[i]) == 0)
+            {
+                setLatency(static_cast<SyscallClass>(i), LatencyDistribution::parse(spec.substr(equals + 1)));
+                return;
+            }
+    throw std::invalid_argument("Invalid latency injection: " + spec);
+}
+
+void LatencyInjectingSyscallBackend::delay(SyscallClass syscallClass)
+{
+    std::chrono::nanoseconds latency;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto& distribution(latencies[static_cast<size_t>(syscallClass)]);
+        if (distribution.empty())
+            return;
+        latency = distribution.sample(generator);
+    }
+    /**
+     * Sleeping overshoots by tens of microseconds, so short delays spin
+     */
+    if (latency < std::chrono::microseconds(200))
+    {
+        const auto until(std::chrono::steady_clock::now() + latency);
+        while (std::chrono::steady_clock::now() < until)
+            ;
+    }
+    else
+        std::this_thread::sleep_for(latency);
+}
+
+TraceRecorder::TraceRecorder(const std::string& traceFile):
+    output(traceFile, std::ios::binary | std::ios::trunc),
+    start(std::chrono::steady_clock::now())
+{
+    if (!output)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", traceFile, errno).c_str());
+    append(TRACE_MAGIC);
+    append(TRACE_VERSION);
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    flush();
+}
+
+void TraceRecorder::record(TraceOp op, PathId id, size_t size)
+{
+    const auto now(std::chrono::steady_clock::now());
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto inserted(pathIds.emplace(id, static_cast<uint32_t>(pathIds.size())));
+    const uint32_t pathId(inserted.first->second);
+    if (inserted.second)
+    {
+        const auto filePath(PathTable::instance().path(id));
+        append(static_cast<uint8_t>(TraceOp::DEFINE_PATH));
+        append(pathId);
+        append(static_cast<uint32_t>(filePath.size()));
+        buffer += filePath;
+    }
+    append(static_cast<uint8_t>(op));
+    append(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()));
+    append(pathId);
+    append(static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX)));
+    if (buffer.size() >= 1024 * 1024)
+        flush();
+}
+
+void TraceRecorder::flush()
+{
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    output.flush();
+    buffer.clear();
+}
+
+namespace
+{
+    template <typename T>
+    bool readTraceValue(const std::string& data, size_t& offset, T& value)
+    {
+        if (data.size() - offset < sizeof(value))
+            return false;
+        memcpy(&value, data.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return true;
+    }
+
+    Trace loadTrace(const std::string& traceFile)
+    {
+        std::ifstream input(traceFile, std::ios::binary);
+        if (!input)
+            throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", traceFile, errno).c_str());
+        const std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+        size_t offset(0);
+        uint32_t magic(0);
+        uint32_t version(0);
+        if (!readTraceValue(data, offset, magic) || (magic != TRACE_MAGIC) ||
+            !readTraceValue(data, offset, version) || (version != TRACE_VERSION))
+            throw std::runtime_error("Not a commit trace: " + traceFile);
+
+        Trace trace;
+        while (offset < data.size())
+        {
+            uint8_t op(0);
+            readTraceValue(data, offset, op);
+            if (op == static_cast<uint8_t>(TraceOp::DEFINE_PATH))
+            {
+                uint32_t pathId(0);
+                uint32_t length(0);
+                if (!readTraceValue(data, offset, pathId) || !readTraceValue(data, offset, length) ||
+                    (pathId != trace.paths.size()) || (data.size() - offset < length))
+                    throw std::runtime_error("Corrupted path definition in " + traceFile);
+                trace.paths.emplace_back(data, offset, length);
+                offset += length;
+            }
+            else if ((op == static_cast<uint8_t>(TraceOp::COMMIT)) || (op == static_cast<uint8_t>(TraceOp::READ)))
+            {
+                TraceRecord record;
+                record.op = static_cast<TraceOp>(op);
+                if (!readTraceValue(data, offset, record.timestamp) ||
+                    !readTraceValue(data, offset, record.pathId) ||
+                    !readTraceValue(data, offset, record.size) ||
+                    (record.pathId >= trace.paths.size()))
+                {
+                    /**
+                     * Recorder was killed mid-write, keep what we have
+                     */
+                    if (offset >= data.size())
+                        break;
+                    throw std::runtime_error("Corrupted record in " + traceFile);
+                }
+                trace.records.push_back(record);
+            }
+            else
+                throw std::runtime_error("Unknown record type in " + traceFile);
+        }
+        return trace;
+    }
+}
+
+TimelineRecorder::TimelineRecorder(std::chrono::nanoseconds interval):
+    interval(interval),
+    start(std::chrono::steady_clock::now())
+{
+}
+
+std::vector<TimelineRecorder::Event>& TimelineRecorder::threadEvents()
+{
+    thread_local TimelineRecorder* owner(nullptr);
+    thread_local std::vector<Event>* buffer(nullptr);
+    if (owner != this)
+    {
+        std::unique_ptr<std::vector<Event>> created(new std::vector<Event>());
+        created->reserve(4096);
+        buffer = created.get();
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(std::move(created));
+        owner = this;
+    }
+    return *buffer;
+}
+
+void TimelineRecorder::commitBegin(PathId, size_t)
+{
+    threadEvents().push_back(Event{ now(), BEGIN });
+}
+
+void TimelineRecorder::commitEnd(PathId, int)
+{
+    auto& buffer(threadEvents());
+    const uint64_t end(now());
+    /**
+     * Commits do not nest, so the matching begin is the last event of
+     * this thread
+     */
+    const uint64_t begin(buffer.empty() ? end : buffer.back().time);
+    buffer.push_back(Event{ end, end - begin });
+}
+
+void TimelineRecorder::print(std::ostream& os)
+{
+    std::vector<Event> all;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& buffer: events)
+            all.insert(all.end(), buffer->begin(), buffer->end());
+    }
+    std::stable_sort(all.begin(), all.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+
+    const uint64_t step(static_cast<uint64_t>(interval.count()));
+    const double seconds(static_cast<double>(step) / 1e9);
+    os << "interval_start_s,commits,commits_per_s,p50_us,p99_us,max_us,max_in_flight" << std::endl;
+    if (all.empty())
+        return;
+
+    long inFlight(0);
+    size_t next(0);
+    for (uint64_t begin = 0; begin <= all.back().time; begin += step)
+    {
+        /**
+         * Stalled intervals with nothing finishing still show the
+         * commits stuck in flight
+         */
+        long maxInFlight(inFlight);
+        LatencyHistogram latency;
+        for (; (next < all.size()) && (all[next].time < begin + step); ++next)
+        {
+            if (all[next].latency == BEGIN)
+                maxInFlight = std::max(maxInFlight, ++inFlight);
+            else
+            {
+                latency.record(all[next].latency);
+                inFlight = std::max(0L, inFlight - 1);
+            }
+        }
+        os << static_cast<double>(begin) / 1e9 << ','
+           << latency.count() << ','
+           << static_cast<double>(latency.count()) / seconds << ','
+           << static_cast<double>(latency.percentile(0.5)) / 1000.0 << ','
+           << static_cast<double>(latency.percentile(0.99)) / 1000.0 << ','
+           << static_cast<double>(latency.max()) / 1000.0 << ','
+           << maxInFlight << std::endl;
+    }
+}
+
+HistogramLogRecorder::HistogramLogRecorder(std::chrono::nanoseconds interval):
+    interval(interval),
+    start(std::chrono::steady_clock::now()),
+    startTime(std::chrono::system_clock::now())
+{
+}
+
+HistogramLogRecorder::ThreadState& HistogramLogRecorder::threadState()
+{
+    thread_local HistogramLogRecorder* owner(nullptr);
+    thread_local ThreadState* state(nullptr);
+    if (owner != this)
+    {
+        std::unique_ptr<ThreadState> created(new ThreadState());
+        state = created.get();
+        std::lock_guard<std::mutex> lock(mutex);
+        states.push_back(std::move(created));
+        owner = this;
+    }
+    return *state;
+}
+
+void HistogramLogRecorder::commitBegin(PathId, size_t)
+{
+    threadState().commitStart = std::chrono::steady_clock::now();
+}
+
+void HistogramLogRecorder::commitEnd(PathId, int error)
+{
+    if (error)
+        return;
+    auto& state(threadState());
+    const auto end(std::chrono::steady_clock::now());
+    const auto index(static_cast<size_t>((end - start) / interval));
+    if (state.intervals.size() <= index)
+        state.intervals.resize(index + 1);
+    state.intervals[index].record(end - state.commitStart);
+}
+
+HistogramLog HistogramLogRecorder::log()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    HistogramLog log;
+    log.startTime = std::chrono::duration<double>(startTime.time_since_epoch()).count();
+    const double length(std::chrono::duration<double>(interval).count());
+    for (const auto& state: states)
+        for (size_t i = 0; i < state->intervals.size(); ++i)
+        {
+            if (log.intervals.size() <= i)
+                log.intervals.push_back(HistogramInterval{ static_cast<double>(i) * length, length, LatencyHistogram() });
+            log.intervals[i].histogram.merge(state->intervals[i]);
+        }
+    /**
+     * Idle intervals are not worth a line
+     */
+    log.intervals.erase(std::remove_if(log.intervals.begin(), log.intervals.end(),
+                                       [](const HistogramInterval& interval) { return interval.histogram.count() == 0; }),
+                        log.intervals.end());
+    return log;
+}
+
+namespace
+{
+    const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    void appendVarint(std::string& out, int64_t value)
+    {
+        uint64_t zigzag((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+        while (zigzag >= 0x80)
+        {
+            out.push_back(static_cast<char>((zigzag & 0x7f) | 0x80));
+            zigzag >>= 7;
+        }
+        out.push_back(static_cast<char>(zigzag));
+    }
+
+    bool readVarint(const std::string& in, size_t& offset, int64_t& value)
+    {
+        uint64_t zigzag(0);
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (offset >= in.size())
+                return false;
+            const auto byte(static_cast<uint8_t>(in[offset++]));
+            zigzag |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+            {
+                value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string encodeBase64(const std::string& data)
+    {
+        std::string out;
+        out.reserve((data.size() + 2) / 3 * 4);
+        for (size_t i = 0; i < data.size(); i += 3)
+        {
+            const size_t n(std::min<size_t>(3, data.size() - i));
+            uint32_t group(0);
+            for (size_t j = 0; j < 3; ++j)
+                group = (group << 8) | (j < n ? static_cast<uint8_t>(data[i + j]) : 0);
+            for (size_t j = 0; j < 4; ++j)
+                out.push_back(j <= n ? BASE64_ALPHABET[(group >> (18 - 6 * j)) & 0x3f] : '=');
+        }
+        return out;
+    }
+
+    bool decodeBase64(const std::string& in, std::string& out)
+    {
+        if (in.size() % 4)
+            return false;
+        out.clear();
+        for (size_t i = 0; i < in.size(); i += 4)
+        {
+            uint32_t group(0);
+            size_t padding(0);
+            for (size_t j = 0; j < 4; ++j)
+            {
+                const char c(in[i + j]);
+                const char* found(c ? strchr(BASE64_ALPHABET, c) : nullptr);
+                if ((c == '=') && (i + 4 == in.size()) && (j >= 2))
+                    ++padding;
+                else if (!found || padding)
+                    return false;
+                group = (group << 6) | (found ? static_cast<uint32_t>(found - BASE64_ALPHABET) : 0);
+            }
+            for (size_t j = 0; j < 3 - padding; ++j)
+                out.push_back(static_cast<char>((group >> (16 - 8 * j)) & 0xff));
+        }
+        return true;
+    }
+
+    std::string encodeHistogram(const LatencyHistogram& histogram)
+    {
+        std::string payload;
+        appendVarint(payload, static_cast<int64_t>(LatencyHistogram::BUCKETS));
+        appendVarint(payload, static_cast<int64_t>(histogram.sumOfValues()));
+        appendVarint(payload, static_cast<int64_t>(histogram.max()));
+        int64_t zeros(0);
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i)
+        {
+            const auto count(static_cast<int64_t>(histogram.bucketCount(i)));
+            if (count == 0)
+            {
+                ++zeros;
+                continue;
+            }
+            if (zeros == 1)
+                appendVarint(payload, 0);
+            else if (zeros > 1)
+                appendVarint(payload, -zeros);
+            zeros = 0;
+            appendVarint(payload, count);
+        }
+        return encodeBase64(payload);
+    }
+
+    LatencyHistogram decodeHistogram(const std::string& encoded)
+    {
+        std::string payload;
+        if (!decodeBase64(encoded, payload))
+            throw std::runtime_error("Histogram is not base64");
+        size_t offset(0);
+        int64_t buckets(0);
+        int64_t sum(0);
+        int64_t maxValue(0);
+        if (!readVarint(payload, offset, buckets) || !readVarint(payload, offset, sum) || !readVarint(payload, offset, maxValue))
+            throw std::runtime_error("Truncated histogram header");
+        if (buckets != static_cast<int64_t>(LatencyHistogram::BUCKETS))
+            throw std::runtime_error("Histogram has " + std::to_string(buckets) + " buckets, expected " +
+                                     std::to_string(LatencyHistogram::BUCKETS));
+        std::vector<uint64_t> counts(LatencyHistogram::BUCKETS, 0);
+        size_t bucket(0);
+        while (offset < payload.size())
+        {
+            int64_t value(0);
+            if (!readVarint(payload, offset, value))
+                throw std::runtime_error("Truncated histogram");
+            if (value < 0)
+            {
+                bucket += static_cast<size_t>(-value);
+                continue;
+            }
+            if (bucket >= counts.size())
+                throw std::runtime_error("Histogram has too many buckets");
+            counts[bucket++] = static_cast<uint64_t>(value);
+        }
+        return LatencyHistogram::fromCounts(std::move(counts), static_cast<uint64_t>(sum), static_cast<uint64_t>(maxValue));
+    }
+
+    void writeHistogramLog(std::ostream& os, const HistogramLog& log)
+    {
+        const auto flags(os.flags());
+        os << std::fixed << std::setprecision(3)
+           << "#[Histogram log of fsynctest commit latencies in ns, LatencyHistogram buckets as base64 zigzag LEB128]" << std::endl
+           << "#[StartTime: " << log.startTime << " (seconds since epoch)]" << std::endl
+           << "\"StartTimestamp\",\"Interval_Length\",\"Interval_Max\",\"Interval_Compressed_Histogram\"" << std::endl;
+        for (const auto& interval: log.intervals)
+            os << interval.start << ',' << interval.length << ','
+               << static_cast<double>(interval.histogram.max()) / 1e6 << ','
+               << encodeHistogram(interval.histogram) << std::endl;
+        os.flags(flags);
+    }
+
+    HistogramLog loadHistogramLog(const std::string& logFile)
+    {
+        std::ifstream input(logFile);
+        if (!input)
+            throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", logFile, errno).c_str());
+        HistogramLog log;
+        log.startTime = 0;
+        std::string line;
+        for (unsigned long number = 1; std::getline(input, line); ++number)
+        {
+            if (line.compare(0, 13, "#[StartTime: ") == 0)
+                log.startTime = std::atof(line.c_str() + 13);
+            if (line.empty() || (line[0] == '#') || (line[0] == '"'))
+                continue;
+            std::istringstream fields(line);
+            std::string start;
+            std::string length;
+            std::string maxValue;
+            std::string encoded;
+            if (!std::getline(fields, start, ',') || !std::getline(fields, length, ',') ||
+                !std::getline(fields, maxValue, ',') || !std::getline(fields, encoded))
+                throw std::runtime_error(logFile + ":" + std::to_string(number) + ": expected 4 fields");
+            try
+            {
+                log.intervals.push_back(HistogramInterval{ std::atof(start.c_str()), std::atof(length.c_str()), decodeHistogram(encoded) });
+            }
+            catch (const std::runtime_error& e)
+            {
+                throw std::runtime_error(logFile + ":" + std::to_string(number) + ": " + e.what());
+            }
+        }
+        return log;
+    }
+
+    std::string trimString(const std::string& text)
+    {
+        const auto begin(text.find_first_not_of(" \t\r"));
+        if (begin == std::string::npos)
+            return std::string();
+        return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+    }
+
+    void setJobKey(JobSpec& job, const std::string& key, const std::string& value)
+    {
+        const auto number = [&]()
+        {
+            size_t used(0);
+            const double parsed(std::stod(value, &used));
+            if ((used != value.size()) || (parsed < 0))
+                throw std::invalid_argument("Invalid number: " + value);
+            return parsed;
+        };
+        if ((key == "directory") || (key == "directories"))
+        {
+            job.directories.clear();
+            for (const auto& directory: splitString(value, ','))
+                if (!trimString(directory).empty())
+                    job.directories.push_back(trimString(directory));
+        }
+        else if (key == "files")
+            job.files = static_cast<long>(number());
+        else if (key == "size")
+            job.size = LatencyDistribution::parse(value.find(':') == std::string::npos ? "fixed:" + value : value, &parseSize);
+        else if (key == "rate")
+            job.rate = number();
+        else if (key == "threads")
+            job.threads = static_cast<long>(number());
+        else if (key == "durability")
+        {
+            if (value == "immediate")
+                job.durability = Durability::IMMEDIATE;
+            else if (value == "deferred")
+                job.durability = Durability::DEFERRED;
+            else if (value == "grouped")
+                job.durability = Durability::GROUPED;
+            else
+                throw std::invalid_argument("Invalid durability: " + value);
+        }
+        else if (key == "duration")
+            job.duration = std::chrono::microseconds(static_cast<long long>(parseDuration(value)));
+        else if (key == "count")
+            job.count = static_cast<long>(number());
+        else
+            throw std::invalid_argument("Unknown key: " + key);
+    }
+
+    std::vector<JobSpec> loadJobFile(const std::string& jobFile, const JobSpec& defaults)
+    {
+        std::ifstream input(jobFile);
+        if (!input)
+            throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("open", jobFile, errno).c_str());
+
+        std::vector<JobSpec> jobs;
+        JobSpec global(defaults);
+        JobSpec* current(nullptr);
+        std::string line;
+        for (unsigned long number = 1; std::getline(input, line); ++number)
+        {
+            const auto where(jobFile + ":" + std::to_string(number) + ": ");
+            line = trimString(line);
+            if (line.empty() || (line[0] == '#') || (line[0] == ';'))
+                continue;
+            if (line[0] == '[')
+            {
+                if (line.back() != ']')
+                    throw std::runtime_error(where + "unterminated section");
+                const auto name(trimString(line.substr(1, line.size() - 2)));
+                if (name == "global")
+                    current = &global;
+                else
+                {
+                    if (name.empty() || (name.find('/') != std::string::npos))
+                        throw std::runtime_error(where + "invalid job name \"" + name + '"');
+                    for (const auto& job: jobs)
+                        if (job.name == name)
+                            throw std::runtime_error(where + "duplicate job \"" + name + '"');
+                    jobs.push_back(global);
+                    jobs.back().name = name;
+                    current = &jobs.back();
+                }
+                continue;
+            }
+            const auto equals(line.find('='));
+            if (equals == std::string::npos)
+                throw std::runtime_error(where + "expected <key> = <value>");
+            if (!current)
+                throw std::runtime_error(where + "key outside of a section");
+            try
+            {
+                setJobKey(*current, trimString(line.substr(0, equals)), trimString(line.substr(equals + 1)));
+            }
+            catch (const std::invalid_argument& e)
+            {
+                throw std::runtime_error(where + e.what());
+            }
+        }
+
+        if (jobs.empty())
+            throw std::runtime_error(jobFile + ": no jobs");
+        for (const auto& job: jobs)
+        {
+            const auto where(jobFile + ": job \"" + job.name + "\": ");
+            if (job.directories.empty())
+                throw std::runtime_error(where + "no directory");
+            if ((job.files < 1) || (job.threads < 1))
+                throw std::runtime_error(where + "files and threads must be at least 1");
+            if ((job.duration.count() == 0) && (job.count == 0))
+                throw std::runtime_error(where + "needs a duration or a count");
+        }
+        return jobs;
+    }
+
+    /**
+     * Draws a histogram of the same count from the distribution of
+     * histogram, bucket by bucket as a chain of binomials
+     */
+    LatencyHistogram resampleHistogram(const LatencyHistogram& histogram, std::mt19937_64& random)
+    {
+        std::vector<uint64_t> counts(LatencyHistogram::BUCKETS, 0);
+        unsigned long long remaining(histogram.count());
+        uint64_t remainingWeight(histogram.count());
+        for (size_t i = 0; (i < LatencyHistogram::BUCKETS) && remaining; ++i)
+        {
+            const uint64_t weight(histogram.bucketCount(i));
+            if (!weight)
+                continue;
+            unsigned long long drawn(remaining);
+            if (weight < remainingWeight)
+            {
+                std::binomial_distribution<unsigned long long> binomial(remaining, static_cast<double>(weight) / static_cast<double>(remainingWeight));
+                drawn = binomial(random);
+            }
+            counts[i] = drawn;
+            remaining -= drawn;
+            remainingWeight -= weight;
+        }
+        return LatencyHistogram::fromCounts(std::move(counts), 0, histogram.max());
+    }
+
+    bool compareWithBaseline(std::ostream& os, const LatencyHistogram& baseline, const LatencyHistogram& current,
+                             double threshold, uint64_t seed)
+    {
+        static const size_t RESAMPLES = 1000;
+        const double quantiles[] = { 0.5, 0.99 };
+        const char* names[] = { "p50", "p99" };
+
+        os << "Baseline comparison: " << baseline.count() << " baseline and " << current.count()
+           << " current commits, 95% CI of the change from " << RESAMPLES << " bootstrap resamples" << std::endl;
+        if (!baseline.count() || !current.count())
+        {
+            os << "Nothing to compare" << std::endl;
+            return false;
+        }
+
+        std::vector<std::vector<double>> changes(2);
+        std::mt19937_64 random(seed);
+        for (size_t i = 0; i < RESAMPLES; ++i)
+        {
+            const auto baselineSample(resampleHistogram(baseline, random));
+            const auto currentSample(resampleHistogram(current, random));
+            for (size_t j = 0; j < 2; ++j)
+            {
+                const auto before(static_cast<double>(std::max<uint64_t>(1, baselineSample.percentile(quantiles[j]))));
+                changes[j].push_back(static_cast<double>(currentSample.percentile(quantiles[j])) / before - 1.0);
+            }
+        }
+
+        const auto us = [](uint64_t nanoseconds) { return static_cast<double>(nanoseconds) / 1000.0; };
+        const auto percent = [](double fraction) { return fraction * 100.0; };
+        os << std::left << std::setw(10) << "quantile" << std::right
+           << std::setw(14) << "baseline_us" << std::setw(14) << "current_us"
+           << std::setw(12) << "change_%" << std::setw(12) << "ci_low_%" << std::setw(12) << "ci_high_%" << std::endl;
+        bool regressed(false);
+        for (size_t j = 0; j < 2; ++j)
+        {
+            auto& samples(changes[j]);
+            std::sort(samples.begin(), samples.end());
+            const double low(samples[static_cast<size_t>(0.025 * RESAMPLES)]);
+            const double high(samples[static_cast<size_t>(0.975 * RESAMPLES) - 1]);
+            const auto before(baseline.percentile(quantiles[j]));
+            const auto after(current.percentile(quantiles[j]));
+            const double change(static_cast<double>(after) / static_cast<double>(std::max<uint64_t>(1, before)) - 1.0);
+            os << std::left << std::setw(10) << names[j] << std::right
+               << std::setw(14) << us(before) << std::setw(14) << us(after) << std::showpos
+               << std::setw(12) << percent(change) << std::setw(12) << percent(low) << std::setw(12) << percent(high)
+               << std::noshowpos << std::endl;
+            if (low > threshold)
+            {
+                os << "Regression: " << names[j] << " is at least " << percent(low) << "% slower than the baseline" << std::endl;
+                regressed = true;
+            }
+        }
+        if (!regressed)
+            os << "No regression beyond " << percent(threshold) << "%" << std::endl;
+        return regressed;
+    }
+}
+
+PathStatsRegistry::Current& PathStatsRegistry::current()
+{
+    thread_local Current current = { nullptr, nullptr, 0, std::chrono::steady_clock::time_point() };
+    return current;
+}
+
+PathStatsRegistry::Counters& PathStatsRegistry::counters(PathId id)
+{
+    if (id < known.load(std::memory_order_acquire))
+        return paths[id];
+    std::lock_guard<std::mutex> lock(mutex);
+    while (paths.size() <= id)
+        paths.append();
+    known.store(paths.size(), std::memory_order_release);
+    return paths[id];
+}
+
+void PathStatsRegistry::commitBegin(PathId id, size_t size)
+{
+    auto& commit(current());
+    commit.owner = this;
+    commit.counters = &counters(id);
+    commit.size = size;
+    commit.start = std::chrono::steady_clock::now();
+}
+
+void PathStatsRegistry::commitElided(PathId)
+{
+    auto& commit(current());
+    if (commit.owner == this)
+        ++commit.counters->elided;
+}
+
+void PathStatsRegistry::commitEnd(PathId, int error)
+{
+    auto& commit(current());
+    if (commit.owner != this)
+        return;
+    commit.owner = nullptr;
+    auto& counters(*commit.counters);
+    const uint64_t latency(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - commit.start).count()));
+    ++counters.commits;
+    counters.bytes += commit.size;
+    counters.totalLatency += latency;
+    uint64_t max(counters.maxLatency.load(std::memory_order_relaxed));
+    while ((latency > max) && !counters.maxLatency.compare_exchange_weak(max, latency, std::memory_order_relaxed))
+        ;
+    if (error)
+        ++counters.failures;
+}
+
+std::vector<PathStats> PathStatsRegistry::dump() const
+{
+    std::vector<PathStats> stats;
+    const uint32_t size(known.load(std::memory_order_acquire));
+    for (PathId id = 0; id < size; ++id)
+    {
+        const auto& counters(paths[id]);
+        /**
+         * Ids are shared with every other CommittedFile of the process,
+         * most of them may never have been committed while this
+         * registry was installed
+         */
+        if ((counters.commits.load() == 0) && (counters.elided.load() == 0))
+            continue;
+        stats.push_back(PathStats{ PathTable::instance().path(id),
+                                   counters.commits.load(),
+                                   counters.bytes.load(),
+                                   counters.totalLatency.load(),
+                                   counters.maxLatency.load(),
+                                   counters.elided.load(),
+                                   counters.failures.load() });
+    }
+    return stats;
+}
+
+std::vector<PathStats> PathStatsRegistry::top(size_t n) const
+{
+    auto stats(dump());
+    const auto hotter = [](const PathStats& a, const PathStats& b) { return a.totalLatency > b.totalLatency; };
+    if (stats.size() > n)
+    {
+        std::partial_sort(stats.begin(), stats.begin() + static_cast<std::ptrdiff_t>(n), stats.end(), hotter);
+        stats.resize(n);
+    }
+    else
+        std::sort(stats.begin(), stats.end(), hotter);
+    return stats;
+}
+
+void PathStatsRegistry::printTop(std::ostream& os, const std::vector<PathStats>& stats)
+{
+    os << "Hottest paths by total commit time:" << std::endl;
+    for (const auto& path: stats)
+        os << "  \"" << path.path << "\" commits=" << path.commits
+           << " bytes=" << path.bytes
+           << " total=" << static_cast<double>(path.totalLatency) / 1e6 << "ms"
+           << " mean=" << (path.commits ? static_cast<double>(path.totalLatency) / static_cast<double>(path.commits) / 1000.0 : 0.0) << "us"
+           << " max=" << static_cast<double>(path.maxLatency) / 1000.0 << "us"
+           << " elided=" << path.elided
+           << " failures=" << path.failures << std::endl;
+}
+
+void PathStatsRegistry::printCsv(std::ostream& os, const std::vector<PathStats>& stats)
+{
+    os << "path,commits,bytes,total_us,max_us,elided,failures" << std::endl;
+    for (const auto& path: stats)
+        os << path.path << ','
+           << path.commits << ','
+           << path.bytes << ','
+           << static_cast<double>(path.totalLatency) / 1000.0 << ','
+           << static_cast<double>(path.maxLatency) / 1000.0 << ','
+           << path.elided << ','
+           << path.failures << std::endl;
+}
+
+namespace
+{
+    /**
+     * Returns avg10 of the "some" and "full" lines
+     */
+    void readPressure(const char* file, double& some, double& full)
+    {
+        std::ifstream input(file);
+        std::string line;
+        while (std::getline(input, line))
+        {
+            const auto avg10(line.find("avg10="));
+            if (avg10 == std::string::npos)
+                continue;
+            const double value(std::atof(line.c_str() + avg10 + 6));
+            if (line.compare(0, 4, "some") == 0)
+                some = value;
+            else if (line.compare(0, 4, "full") == 0)
+                full = value;
+        }
+    }
+}
+
+PressureSnapshot PressureSnapshot::take(const std::string& filePath)
+{
+    PressureSnapshot snapshot;
+    readPressure("/proc/pressure/io", snapshot.ioSome, snapshot.ioFull);
+    readPressure("/proc/pressure/memory", snapshot.memorySome, snapshot.memoryFull);
+
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    long value;
+    std::string unit;
+    while (meminfo >> key >> value)
+    {
+        if (key == "Dirty:")
+            snapshot.dirtyKb = value;
+        else if (key == "Writeback:")
+            snapshot.writebackKb = value;
+        std::getline(meminfo, unit);
+    }
+
+    /**
+     * The real device, whatever syscall backend is installed
+     */
+    struct stat st;
+    if (::stat(dirName(filePath).c_str(), &st) == 0)
+    {
+        std::ifstream inflight("/sys/dev/block/" + std::to_string(major(st.st_dev)) + ':' + std::to_string(minor(st.st_dev)) + "/inflight");
+        inflight >> snapshot.inflightReads >> snapshot.inflightWrites;
+    }
+    return snapshot;
+}
+
+std::atomic<int> SlowCommitRecorder::signalFd(-1);
+
+SlowCommitRecorder::SlowCommitRecorder(std::chrono::nanoseconds threshold, size_t capacity, std::ostream& os):
+    threshold(threshold),
+    capacity(capacity),
+    os(os),
+    next(0),
+    dropped(0)
+{
+    entries.reserve(capacity);
+    if (pipe2(pipeFds, O_CLOEXEC) == -1)
+        throw std::system_error(errno, std::system_category(), "pipe2");
+    signalThread = std::thread(&SlowCommitRecorder::serviceSignals, this);
+    signalFd = pipeFds[1];
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &SlowCommitRecorder::onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+}
+
+SlowCommitRecorder::~SlowCommitRecorder()
+{
+    signal(SIGUSR1, SIG_DFL);
+    signalFd = -1;
+    const char stop('s');
+    while ((::write(pipeFds[1], &stop, 1) == -1) && (errno == EINTR))
+        ;
+    signalThread.join();
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    dump();
+}
+
+void SlowCommitRecorder::onSignal(int)
+{
+    const int savedErrno(errno);
+    const int fd(signalFd.load());
+    const char request('d');
+    if (fd >= 0)
+        /* Ignore errors, a full pipe has dumps pending anyway */
+        (void)!::write(fd, &request, 1);
+    errno = savedErrno;
+}
+
+void SlowCommitRecorder::serviceSignals()
+{
+    char request;
+    while (true)
+    {
+        const ssize_t ret(::read(pipeFds[0], &request, 1));
+        if ((ret == -1) && (errno == EINTR))
+            continue;
+        if ((ret != 1) || (request == 's'))
+            return;
+        dump();
+    }
+}
+
+SlowCommitRecorder::ThreadState& SlowCommitRecorder::threadState()
+{
+    thread_local ThreadState state;
+    return state;
+}
+
+void SlowCommitRecorder::commitBegin(PathId, size_t size)
+{
+    auto& state(threadState());
+    state.commitStart = std::chrono::steady_clock::now();
+    state.size = size;
+    for (auto& phase: state.phases)
+        phase = std::chrono::nanoseconds::zero();
+}
+
+void SlowCommitRecorder::phaseBegin(PathId, CommitPhase)
+{
+    threadState().phaseStart = std::chrono::steady_clock::now();
+}
+
+void SlowCommitRecorder::phaseEnd(PathId, CommitPhase phase)
+{
+    auto& state(threadState());
+    state.phases[static_cast<size_t>(phase)] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - state.phaseStart);
+}
+
+void SlowCommitRecorder::commitEnd(PathId id, int error)
+{
+    const auto& state(threadState());
+    const auto total(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - state.commitStart));
+    if (total >= threshold)
+    {
+        Entry entry;
+        entry.filePath = PathTable::instance().path(id);
+        entry.size = state.size;
+        entry.error = error;
+        entry.when = std::chrono::system_clock::now();
+        entry.total = total;
+        std::copy(std::begin(state.phases), std::end(state.phases), std::begin(entry.phases));
+        entry.pressure = PressureSnapshot::take(entry.filePath);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.size() < capacity)
+            entries.push_back(std::move(entry));
+        else
+        {
+            entries[next] = std::move(entry);
+            ++dropped;
+        }
+        next = (next + 1) % capacity;
+    }
+}
+
+void SlowCommitRecorder::dump()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto us = [](std::chrono::nanoseconds duration) { return static_cast<double>(duration.count()) / 1000.0; };
+    os << "Slow commits (threshold " << us(threshold) << "us): " << entries.size() << " kept";
+    if (dropped)
+        os << ", " << dropped << " older ones dropped";
+    os << std::endl;
+    /**
+     * Oldest first
+     */
+    const size_t oldest(entries.size() < capacity ? 0 : next);
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const auto& entry(entries[(oldest + i) % entries.size()]);
+        const auto when(std::chrono::system_clock::to_time_t(entry.when));
+        char timestamp[32];
+        strftime(timestamp, sizeof(timestamp), "%F %T", localtime(&when));
+        os << timestamp << " \"" << entry.filePath << "\" size=" << entry.size
+           << " total=" << us(entry.total) << "us";
+        for (size_t phase = 0; phase < PHASES; ++phase)
+            os << ' ' << commitPhaseName(static_cast<CommitPhase>(phase)) << '=' << us(entry.phases[phase]) << "us";
+        if (entry.error)
+            os << " error=\"" << strerror(entry.error) << '"';
+        const auto& pressure(entry.pressure);
+        os << " io_some=" << pressure.ioSome << " io_full=" << pressure.ioFull
+           << " memory_some=" << pressure.memorySome << " memory_full=" << pressure.memoryFull
+           << " dirty=" << pressure.dirtyKb << "kB writeback=" << pressure.writebackKb << "kB"
+           << " inflight=" << pressure.inflightReads << '/' << pressure.inflightWrites
+           << std::endl;
+    }
+}
+
+std::atomic<uint64_t> ChromeTraceRecorder::generations(0);
+
+ChromeTraceRecorder::ChromeTraceRecorder():
+    generation(++generations),
+    start(std::chrono::steady_clock::now())
+{
+}
+
+ChromeTraceRecorder::ThreadBuffer& ChromeTraceRecorder::threadBuffer()
+{
+    thread_local uint64_t owner(0);
+    thread_local ThreadBuffer* buffer(nullptr);
+    if (owner != generation)
+    {
+        std::unique_ptr<ThreadBuffer> created(new ThreadBuffer());
+        created->tid = syscall(SYS_gettid);
+        created->events.reserve(CAPACITY);
+        created->next = 0;
+        created->dropped = 0;
+        buffer = created.get();
+        std::lock_guard<std::mutex> lock(mutex);
+        buffers.push_back(std::move(created));
+        owner = generation;
+    }
+    return *buffer;
+}
+
+void ChromeTraceRecorder::record(EventKind kind, PathId id, CommitPhase phase, int64_t value)
+{
+    auto& buffer(threadBuffer());
+    const Event event{ now(), value, id, kind, phase };
+    if (buffer.events.size() < CAPACITY)
+        buffer.events.push_back(event);
+    else
+    {
+        buffer.events[buffer.next] = event;
+        ++buffer.dropped;
+    }
+    buffer.next = (buffer.next + 1) % CAPACITY;
+}
+
+void ChromeTraceRecorder::commitBegin(PathId id, size_t size)
+{
+    record(EventKind::COMMIT_BEGIN, id, CommitPhase::OPEN, static_cast<int64_t>(size));
+}
+
+void ChromeTraceRecorder::phaseBegin(PathId id, CommitPhase phase)
+{
+    record(EventKind::PHASE_BEGIN, id, phase, 0);
+}
+
+void ChromeTraceRecorder::phaseEnd(PathId id, CommitPhase phase)
+{
+    record(EventKind::PHASE_END, id, phase, 0);
+}
+
+void ChromeTraceRecorder::commitElided(PathId id)
+{
+    record(EventKind::ELIDED, id, CommitPhase::RENAME, 0);
+}
+
+void ChromeTraceRecorder::commitEnd(PathId id, int error)
+{
+    record(EventKind::COMMIT_END, id, CommitPhase::OPEN, error);
+}
+
+void ChromeTraceRecorder::writeString(std::ostream& os, const std::string& value)
+{
+    os << '"';
+    for (const char c: value)
+    {
+        if ((c == '"') || (c == '\\'))
+            os << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            os << escaped;
+        }
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+void ChromeTraceRecorder::write(std::ostream& os)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& table(PathTable::instance());
+    const long pid(getpid());
+    const auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+    unsigned long dropped(0);
+    bool first(true);
+    const auto separator = [&os, &first]() { os << (first ? "\n" : ",\n"); first = false; };
+
+    os << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    for (const auto& buffer: buffers)
+    {
+        dropped += buffer->dropped;
+        separator();
+        os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+           << ",\"args\":{\"name\":\"commit thread " << buffer->tid << "\"}}";
+
+        /**
+         * Begin and end are paired into complete events. After the ring
+         * wrapped the first ends may have lost their begins, those are
+         * skipped.
+         */
+        const auto& events(buffer->events);
+        const size_t oldest(events.size() < CAPACITY ? 0 : buffer->next);
+        const Event* commit(nullptr);
+        const Event* phase(nullptr);
+        for (size_t i = 0; i < events.size(); ++i)
+        {
+            const auto& event(events[(oldest + i) % events.size()]);
+            switch (event.kind)
+            {
+            case EventKind::COMMIT_BEGIN:
+                commit = &event;
+                phase = nullptr;
+                break;
+            case EventKind::PHASE_BEGIN:
+                phase = &event;
+                break;
+            case EventKind::PHASE_END:
+                if (phase && (phase->phase == event.phase))
+                {
+                    separator();
+                    os << "{\"name\":\"" << commitPhaseName(event.phase) << "\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":" << pid
+                       << ",\"tid\":" << buffer->tid << ",\"ts\":" << us(phase->time) << ",\"dur\":" << us(event.time - phase->time)
+                       << ",\"args\":{\"path\":";
+                    writeString(os, table.path(event.path));
+                    os << "}}";
+                }
+                phase = nullptr;
+                break;
+            case EventKind::ELIDED:
+                separator();
+                os << "{\"name\":\"elided\",\"cat\":\"commit\",\"ph\":\"i\",\"s\":\"t\",\"pid\":" << pid
+                   << ",\"tid\":" << buffer->tid << ",\"ts\":" << us(event.time) << ",\"args\":{\"path\":";
+                writeString(os, table.path(event.path));
+                os << "}}";
+                break;
+            case EventKind::COMMIT_END:
+                if (commit)
+                {
+                    separator();
+                    os << "{\"name\":\"commit\",\"cat\":\"commit\",\"ph\":\"X\",\"pid\":" << pid
+                       << ",\"tid\":" << buffer->tid << ",\"ts\":" << us(commit->time) << ",\"dur\":" << us(event.time - commit->time)
+                       << ",\"args\":{\"path\":";
+                    writeString(os, table.path(event.path));
+                    os << ",\"size\":" << commit->value << ",\"error\":" << event.value << "}}";
+                }
+                commit = nullptr;
+                phase = nullptr;
+                break;
+            }
+        }
+    }
+    os << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":" << dropped << "}}" << std::endl;
+}
+
+GroupCommitter::DirectoryGroup::DirectoryGroup():
+    requested(0),
+    done(0),
+    syncing(false),
+    lastArrival(std::chrono::steady_clock::now()),
+    interarrivalNs(1e9),
+    syncCostNs(1e6),
+    gain(1.0),
+    lastWindow(0),
+    lastP99(0),
+    batches(0)
+{
+}
+
+std::chrono::nanoseconds GroupCommitter::DirectoryGroup::window(const GroupCommitConfig& config, double ioPressure) const
+{
+    /**
+     * Commits expected to arrive during one fsync. Below one there is
+     * nobody to wait for.
+     */
+    const double load(syncCostNs / std::max(interarrivalNs, 1.0));
+    double window(gain * syncCostNs * std::min(1.0, load) * (1.0 + ioPressure / 25.0));
+    window = std::min(window, static_cast<double>(config.maxWindow.count()));
+    /**
+     * Never plan to blow the target on our own
+     */
+    window = std::min(window, std::max(0.0, static_cast<double>(config.p99Target.count()) - syncCostNs));
+    return std::chrono::nanoseconds(static_cast<long long>(window));
+}
+
+void GroupCommitter::DirectoryGroup::adapt(const GroupCommitConfig& config)
+{
+    if (recentWaits.count() < 128)
+        return;
+    lastP99 = recentWaits.percentile(0.99);
+    if (lastP99 > static_cast<uint64_t>(config.p99Target.count()))
+        gain = std::max(MIN_GAIN, gain * 0.7);
+    recentWaits = LatencyHistogram();
+}
+
+GroupCommitter::GroupCommitter():
+    pressure(0)
+{
+}
+
+GroupCommitter& GroupCommitter::instance()
+{
+    static GroupCommitter committer;
+    return committer;
+}
+
+void GroupCommitter::configure(const GroupCommitConfig& newConfig)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    config = newConfig;
+    shared.reset(config.sharedSegment.empty() ? nullptr : new SharedDirectorySync(config.sharedSegment));
+}
+
+IoStatus GroupCommitter::syncNow(const std::string& directory)
+{
+    if (shared)
+        return shared->syncDirectory(directory);
+    ScopedFd dirFd(syscalls().openat(AT_FDCWD, directory.c_str(), O_RDONLY | O_CLOEXEC, 0));
+    if (dirFd == -1)
+        return IoStatus::fromErrno("open", directory, "", "");
+    if (syscalls().fsync(dirFd) == -1)
+        return IoStatus::fromErrno("fsync", directory, "", "");
+    if (dirFd.close() == -1)
+        return IoStatus::fromErrno("close", directory, "", "");
+    return IoStatus();
+}
+
+GroupCommitter::DirectoryGroup& GroupCommitter::group(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& group(groups[directory]);
+    if (!group)
+        group.reset(new DirectoryGroup());
+    return *group;
+}
+
+double GroupCommitter::ioPressure()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto now(std::chrono::steady_clock::now());
+    if (now - pressureSampled > std::chrono::milliseconds(500))
+    {
+        pressureSampled = now;
+        double some(0);
+        double full(0);
+        readPressure("/proc/pressure/io", some, full);
+        pressure = full;
     }
+    return pressure;
 }
 
-CommittedFile::CommittedFile(const std::string& filePath):
-    filePath(filePath)
+IoStatus GroupCommitter::trySyncDirectory(const std::string& directory)
 {
-    cleanup();
+    auto& group(this->group(directory));
+    std::unique_lock<std::mutex> lock(group.mutex);
+    const auto arrival(std::chrono::steady_clock::now());
+    const double interarrival(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - group.lastArrival).count()));
+    group.interarrivalNs = 0.9 * group.interarrivalNs + 0.1 * interarrival;
+    group.lastArrival = arrival;
+    const unsigned long ticket(++group.requested);
+    group.condition.notify_all();
+
+    while (group.done < ticket)
+    {
+        if (group.syncing)
+        {
+            group.condition.wait(lock);
+            continue;
+        }
+
+        group.syncing = true;
+        lock.unlock();
+        const double pressure(ioPressure());
+        lock.lock();
+        group.lastWindow = group.window(config, pressure);
+        if (group.lastWindow.count() > 0)
+        {
+            const unsigned long before(group.requested);
+            group.condition.wait_until(lock,
+                                       std::chrono::steady_clock::now() + group.lastWindow,
+                                       [&]() { return group.requested - group.done >= config.maxBatch; });
+            /**
+             * A window nobody joined was pure latency. One that paid off
+             * may grow while the p99 has headroom.
+             */
+            if (group.requested == before)
+                group.gain = std::max(DirectoryGroup::MIN_GAIN, group.gain * 0.9);
+            else if (static_cast<double>(group.lastP99) < 0.7 * static_cast<double>(config.p99Target.count()))
+                group.gain = std::min(DirectoryGroup::MAX_GAIN, group.gain * 1.1);
+        }
+        const unsigned long first(group.done + 1);
+        const unsigned long last(group.requested);
+        lock.unlock();
+
+        const auto start(std::chrono::steady_clock::now());
+        const IoStatus status(syncNow(directory));
+        const int error(status.ok() ? 0 : status.error().error);
+        const double cost(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+
+        lock.lock();
+        group.syncCostNs = 0.8 * group.syncCostNs + 0.2 * cost;
+        group.done = last;
+        group.syncing = false;
+        ++group.batches;
+        if (error)
+            group.failures.push_back(Failure{ first, last, error, last - first + 1 });
+        group.condition.notify_all();
+    }
+
+    group.recentWaits.record(std::chrono::steady_clock::now() - arrival);
+    group.adapt(config);
+    for (auto failure = group.failures.begin(); failure != group.failures.end(); ++failure)
+        if ((failure->first <= ticket) && (ticket <= failure->last))
+        {
+            const int error(failure->error);
+            if (--failure->uncollected == 0)
+                group.failures.erase(failure);
+            return IoStatus::failure("fsync", directory, "", "", error);
+        }
+    return IoStatus();
 }
 
-CommittedFile::~CommittedFile()
+GroupCommitStats GroupCommitter::stats()
 {
+    std::lock_guard<std::mutex> lock(mutex);
+    GroupCommitStats stats = GroupCommitStats();
+    stats.directories = groups.size();
+    unsigned long busiest(0);
+    for (const auto& entry: groups)
+    {
+        auto& group(*entry.second);
+        std::lock_guard<std::mutex> groupLock(group.mutex);
+        stats.batches += group.batches;
+        stats.commits += group.done;
+        if (group.done < busiest)
+            continue;
+        busiest = group.done;
+        stats.windowUs = static_cast<double>(group.lastWindow.count()) / 1000.0;
+        stats.syncCostUs = group.syncCostNs / 1000.0;
+        stats.arrivalsPerSecond = 1e9 / std::max(group.interarrivalNs, 1.0);
+        stats.gain = group.gain;
+        stats.observedP99Us = static_cast<double>(group.lastP99) / 1000.0;
+    }
+    stats.ioPressure = pressure;
+    if (shared)
+    {
+        stats.sharedLed = shared->led();
+        stats.sharedJoined = shared->joined();
+    }
+    return stats;
 }
 
-void CommittedFile::write(const std::string& data)
+SharedDirectorySync::SharedDirectorySync(const std::string& name):
+    name(name),
+    segment(nullptr),
+    leaderSyncs(0),
+    joinedSyncs(0)
 {
-    DirFd dirFd(dirName(filePath));
-    /*
-     * First write and sync work-file. Do not touch real-file.
+    bool created(true);
+    int fd(shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if ((fd == -1) && (errno == EEXIST))
+    {
+        created = false;
+        fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    }
+    if (fd == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("shm_open", name, errno).c_str());
+    if (created && (ftruncate(fd, sizeof(Segment)) == -1))
+    {
+        const int error(errno);
+        ::close(fd);
+        shm_unlink(name.c_str());
+        throw std::system_error(error, std::system_category(), buildCommittedFileReadError("ftruncate", name, error).c_str());
+    }
+    /**
+     * The creator may not have sized the object yet
      */
-    auto fileName(baseName(filePath));
-    auto workFileName(fileName + ".work");
-    WriteFd workFileFd(dirFd, workFileName);
-    workFileFd.writeAll(data.data(), data.size());
-    workFileFd.sync();
-    workFileFd.close();
+    struct stat st;
+    for (int i = 0; !created && (fstat(fd, &st) == 0) && (static_cast<size_t>(st.st_size) < sizeof(Segment)); ++i)
+    {
+        if (i == 1000)
+        {
+            ::close(fd);
+            throw std::system_error(EINVAL, std::system_category(), buildCommittedFileReadError("shm_open", name, EINVAL).c_str());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    void* address(mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    const int error(errno);
+    ::close(fd);
+    if (address == MAP_FAILED)
+        throw std::system_error(error, std::system_category(), buildCommittedFileReadError("mmap", name, error).c_str());
+    segment = static_cast<Segment*>(address);
+
+    if (created)
+    {
+        /**
+         * The object is zero-filled, which is a valid empty slot table
+         */
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&segment->mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        segment->version = VERSION;
+        segment->magic.store(MAGIC, std::memory_order_release);
+        return;
+    }
+    for (int i = 0; segment->magic.load(std::memory_order_acquire) != MAGIC; ++i)
+    {
+        if (i == 1000)
+        {
+            munmap(segment, sizeof(Segment));
+            throw std::system_error(EINVAL, std::system_category(), buildCommittedFileReadError("shm_open", name, EINVAL).c_str());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (segment->version != VERSION)
+    {
+        munmap(segment, sizeof(Segment));
+        throw std::system_error(EPROTO, std::system_category(), buildCommittedFileReadError("shm_open", name, EPROTO).c_str());
+    }
+}
+
+SharedDirectorySync::~SharedDirectorySync()
+{
     /**
-     * Posix guarantees that rename is atomic...
+     * The object is left for others still using it. It is tiny and
+     * gone with the next reboot, or remove it with rm /dev/shm/<name>.
      */
-    dirFd.renameFile(workFileName, fileName);
+    munmap(segment, sizeof(Segment));
+}
+
+void SharedDirectorySync::lock()
+{
+    const int ret(pthread_mutex_lock(&segment->mutex));
+    if (ret == EOWNERDEAD)
+        /**
+         * The previous owner died between updates, each of which leaves
+         * the table consistent. A slot it led is taken over by its
+         * waiters.
+         */
+        pthread_mutex_consistent(&segment->mutex);
+    else if (ret != 0)
+        throw std::system_error(ret, std::system_category(), buildCommittedFileReadError("pthread_mutex_lock", name, ret).c_str());
+}
+
+void SharedDirectorySync::unlock()
+{
+    pthread_mutex_unlock(&segment->mutex);
+}
+
+SharedDirectorySync::Slot* SharedDirectorySync::slot(uint64_t device, uint64_t inode)
+{
+    Slot* free(nullptr);
+    for (auto& slot: segment->slots)
+    {
+        if ((slot.device == device) && (slot.inode == inode))
+            return &slot;
+        if (!free && (slot.device == 0) && (slot.inode == 0))
+            free = &slot;
+    }
+    if (free)
+    {
+        free->device = device;
+        free->inode = inode;
+    }
+    return free;
+}
+
+IoStatus SharedDirectorySync::syncDirectory(const std::string& directory)
+{
+    ScopedFd dirFd(syscalls().openat(AT_FDCWD, directory.c_str(), O_RDONLY | O_CLOEXEC, 0));
+    if (dirFd == -1)
+        return IoStatus::fromErrno("open", directory, "", "");
+    struct stat st;
+    if (syscalls().fstat(dirFd, &st) == -1)
+        return IoStatus::fromErrno("fstat", directory, "", "");
+
+    lock();
+    Slot* slot(this->slot(st.st_dev, st.st_ino));
+    if (!slot)
+    {
+        /**
+         * Table full, do it alone
+         */
+        unlock();
+        if (syscalls().fsync(dirFd) == -1)
+            return IoStatus::fromErrno("fsync", directory, "", "");
+        if (dirFd.close() == -1)
+            return IoStatus::fromErrno("close", directory, "", "");
+        return IoStatus();
+    }
+    const uint64_t ticket(++slot->requested);
+    bool led(false);
+    while (slot->done < ticket)
+    {
+        if (slot->leader != 0)
+        {
+            if ((kill(slot->leader, 0) == -1) && (errno == ESRCH))
+            {
+                slot->leader = 0;
+                ++slot->generation;
+                continue;
+            }
+            const uint32_t generation(slot->generation.load());
+            unlock();
+            /**
+             * The timeout bounds how long a dead leader goes unnoticed
+             */
+            struct timespec timeout = { 0, 10 * 1000 * 1000 };
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&slot->generation), FUTEX_WAIT, generation, &timeout, nullptr, 0);
+            lock();
+            continue;
+        }
+
+        slot->leader = getpid();
+        const uint64_t first(slot->done + 1);
+        const uint64_t last(slot->requested);
+        unlock();
+        led = true;
+        const int error(syscalls().fsync(dirFd) == -1 ? errno : 0);
+        lock();
+        if (error)
+        {
+            auto& failure(slot->failures[slot->nextFailure++ % FAILURES]);
+            if (failure.error)
+            {
+                slot->droppedThrough = std::max(slot->droppedThrough, failure.last);
+                slot->droppedError = failure.error;
+            }
+            failure.first = first;
+            failure.last = last;
+            failure.error = error;
+        }
+        slot->done = std::max(slot->done, last);
+        slot->leader = 0;
+        ++slot->generation;
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&slot->generation), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+    int error(0);
+    for (const auto& failure: slot->failures)
+        if ((failure.first <= ticket) && (ticket <= failure.last))
+            error = failure.error;
     /**
-     * ... and with a directory fsync data is actually stored on disk
-     * See: https://lwn.net/Articles/457667/
+     * More fsyncs failed since ours than the ring holds. Reporting
+     * success could be a lie, so assume ours failed too.
      */
-    dirFd.sync();
-    dirFd.close();
+    if (!error && (ticket <= slot->droppedThrough))
+        error = slot->droppedError;
+    unlock();
+    ++(led ? leaderSyncs : joinedSyncs);
+
+    if (error)
+        return IoStatus::failure("fsync", directory, "", "", error);
+    if (dirFd.close() == -1)
+        return IoStatus::fromErrno("close", directory, "", "");
+    return IoStatus();
 }
 
-std::string CommittedFile::read() const
+constexpr double GroupCommitter::DirectoryGroup::MIN_GAIN;
+constexpr double GroupCommitter::DirectoryGroup::MAX_GAIN;
+
+namespace
+{
+    /**
+     * Returns false on EOF or error, errno tells which (0 for EOF)
+     */
+    bool receiveAll(int fd, void* buffer, size_t size)
+    {
+        size_t received(0);
+        while (received < size)
+        {
+            const ssize_t ret(recv(fd, static_cast<char*>(buffer) + received, size - received, 0));
+            if (ret == 0)
+                errno = 0;
+            if (ret <= 0)
+            {
+                if ((ret < 0) && (errno == EINTR))
+                    continue;
+                return false;
+            }
+            received += static_cast<size_t>(ret);
+        }
+        return true;
+    }
+
+    bool sendAll(int fd, const void* buffer, size_t size)
+    {
+        size_t sent(0);
+        while (sent < size)
+        {
+            const ssize_t ret(send(fd, static_cast<const char*>(buffer) + sent, size - sent, MSG_NOSIGNAL));
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            sent += static_cast<size_t>(ret);
+        }
+        return true;
+    }
+
+    /**
+     * Only plain relative paths below the root directory are served
+     */
+    bool isContainedPath(const std::string& path)
+    {
+        if (path.empty() || (path[0] == '/'))
+            return false;
+        size_t start(0);
+        while (start <= path.size())
+        {
+            size_t end(path.find('/', start));
+            if (end == std::string::npos)
+                end = path.size();
+            const auto component(path.substr(start, end - start));
+            if (component.empty() || (component == ".") || (component == ".."))
+                return false;
+            start = end + 1;
+        }
+        return true;
+    }
+
+    sockaddr_un unixAddress(const std::string& socketPath)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path))
+            throw std::system_error(ENAMETOOLONG, std::system_category(), buildCommittedFileReadError("bind", socketPath, ENAMETOOLONG).c_str());
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+        return address;
+    }
+}
+
+CommitDaemon::Client::Client(int fd):
+    fd(fd),
+    ring(nullptr),
+    ringSize(0)
+{
+}
+
+CommitDaemon::Client::~Client()
 {
-    return readFile(filePath);
+    if (ring)
+        munmap(const_cast<char*>(ring), ringSize);
+    ::close(fd);
 }
 
-void CommittedFile::cleanup()
+CommitDaemon::CommitDaemon(const std::string& socketPath,
+                           const std::string& rootDirectory,
+                           const CommitOptions& options,
+                           unsigned workerCount):
+    socketPath(socketPath),
+    rootDirectory(rootDirectory),
+    options(options),
+    listenFd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+    stopping(false),
+    commits(0),
+    accepted(0),
+    closed(false)
 {
+    if (listenFd == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("socket", socketPath, errno).c_str());
+    const auto address(unixAddress(socketPath));
     /**
-     * Remove possibly existing old work file
+     * A stale socket of a previous daemon would make bind fail
      */
-    const auto directory(dirName(filePath));
-    DirFd dirFd(directory);
-    const auto fileName(baseName(filePath));
-    const auto workFileName(fileName + ".work");
-    dirFd.unlink(workFileName);
-    dirFd.close();
+    ::unlink(socketPath.c_str());
+    if ((bind(listenFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1) ||
+        (listen(listenFd, 128) == -1))
+    {
+        const int error(errno);
+        ::close(listenFd);
+        throw std::system_error(error, std::system_category(), buildCommittedFileReadError("bind", socketPath, error).c_str());
+    }
+    for (unsigned i = 0; i < std::max(1u, workerCount); ++i)
+        workers.emplace_back(&CommitDaemon::work, this);
 }
 
-std::string CommittedFile::getPath() const
+CommitDaemon::~CommitDaemon()
+{
+    stop();
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (const auto& clientThread: clientThreads)
+            if (auto client = clientThread.client.lock())
+                shutdown(client->fd, SHUT_RDWR);
+    }
+    for (auto& clientThread: clientThreads)
+        clientThread.thread.join();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        closed = true;
+    }
+    queueCondition.notify_all();
+    for (auto& thread: workers)
+        thread.join();
+}
+
+void CommitDaemon::stop()
+{
+    stopping = true;
+}
+
+void CommitDaemon::run(unsigned long maxCommits)
+{
+    while (!stopping && ((maxCommits == 0) || (commits.load() < maxCommits)))
+    {
+        /**
+         * Polling keeps stop() async-signal-safe
+         */
+        pollfd pfd = { listenFd, POLLIN, 0 };
+        const int ready(poll(&pfd, 1, 100));
+        reapClients();
+        if (ready <= 0)
+            continue;
+        const int fd(accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC));
+        if (fd == -1)
+            continue;
+        ++accepted;
+        std::shared_ptr<Client> client(std::make_shared<Client>(fd));
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clientThreads.push_back(ClientThread{ client, std::thread(&CommitDaemon::serve, this, client) });
+    }
+}
+
+void CommitDaemon::reapClients()
+{
+    std::vector<ClientThread> finished;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        if (finishedThreads.empty())
+            return;
+        const auto done(std::partition(clientThreads.begin(), clientThreads.end(), [this](const ClientThread& clientThread)
+        {
+            return std::find(finishedThreads.begin(), finishedThreads.end(), clientThread.thread.get_id()) == finishedThreads.end();
+        }));
+        std::move(done, clientThreads.end(), std::back_inserter(finished));
+        clientThreads.erase(done, clientThreads.end());
+        finishedThreads.clear();
+    }
+    /**
+     * They have nothing left to do but return
+     */
+    for (auto& clientThread: finished)
+        clientThread.thread.join();
+}
+
+void CommitDaemon::serve(std::shared_ptr<Client> client)
+{
+    CommitRequest request;
+    while (receiveAll(client->fd, &request, sizeof(request)))
+    {
+        if (request.op == CommitRequestOp::COMMIT)
+        {
+            /**
+             * Each length is checked on its own, a sum could wrap
+             */
+            if (!client->ring ||
+                (request.offset > client->ringSize) ||
+                (request.dataLength > client->ringSize - request.offset) ||
+                (request.pathLength > client->ringSize - request.offset - request.dataLength))
+            {
+                acknowledge(*client, request.id, EINVAL);
+                continue;
+            }
+            const char* payload(client->ring + request.offset);
+            Job job{ client, request.id, std::string(payload, request.pathLength), std::string() };
+            if (!isContainedPath(job.path))
+            {
+                acknowledge(*client, request.id, EACCES);
+                continue;
+            }
+            job.data.assign(payload + request.pathLength, request.dataLength);
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                queue.push_back(std::move(job));
+            }
+            queueCondition.notify_one();
+            continue;
+        }
+
+        /**
+         * HELLO, the ring arrives as ancillary data with it. It was
+         * consumed with the header above, so pick up the fd separately.
+         */
+        char byte;
+        char control[CMSG_SPACE(sizeof(int))];
+        iovec iov = { &byte, 1 };
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC) != 1)
+            break;
+        const cmsghdr* header(CMSG_FIRSTHDR(&message));
+        if (!header || (header->cmsg_type != SCM_RIGHTS) || client->ring)
+            break;
+        int ringFd;
+        memcpy(&ringFd, CMSG_DATA(header), sizeof(ringFd));
+        /**
+         * Without the seal the client could shrink the ring under the
+         * mapping, and reading it would raise SIGBUS here
+         */
+        struct stat st;
+        const int seals(fcntl(ringFd, F_GET_SEALS));
+        if ((seals != -1) && (seals & F_SEAL_SHRINK) &&
+            (fstat(ringFd, &st) == 0) && (static_cast<uint64_t>(st.st_size) >= request.offset) && (request.offset > 0))
+        {
+            void* address(mmap(nullptr, request.offset, PROT_READ, MAP_SHARED, ringFd, 0));
+            if (address != MAP_FAILED)
+            {
+                client->ring = static_cast<const char*>(address);
+                client->ringSize = request.offset;
+            }
+        }
+        ::close(ringFd);
+        if (!client->ring)
+            break;
+    }
+    /**
+     * Queued jobs keep the client alive until they are acknowledged
+     */
+    shutdown(client->fd, SHUT_RD);
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    finishedThreads.push_back(std::this_thread::get_id());
+}
+
+void CommitDaemon::work()
+{
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueCondition.wait(lock, [this]() { return closed || !queue.empty(); });
+        if (queue.empty())
+            return;
+        Job job(std::move(queue.front()));
+        queue.pop_front();
+        lock.unlock();
+
+        const IoStatus status(file(job.path).tryWrite(job.data));
+        acknowledge(*job.client, job.id, status.ok() ? 0 : status.error().error);
+    }
+}
+
+void CommitDaemon::acknowledge(Client& client, uint64_t id, int error)
+{
+    const CommitAck ack = { id, error, 0 };
+    {
+        std::lock_guard<std::mutex> lock(client.sendMutex);
+        sendAll(client.fd, &ack, sizeof(ack));
+    }
+    ++commits;
+}
+
+CommittedFile CommitDaemon::file(const std::string& path)
+{
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        const auto found(files.find(path));
+        if (found != files.end())
+            return found->second;
+    }
+    const CommittedFile file(rootDirectory + '/' + path, options);
+    std::lock_guard<std::mutex> lock(filesMutex);
+    /**
+     * An evicted handle is simply created again by the next commit of
+     * its path, its PathTable entry stays
+     */
+    if (files.size() >= MAX_FILES)
+        files.erase(files.begin());
+    files.emplace(path, file);
+    return file;
+}
+
+CommitClient::CommitClient(const std::string& socketPath, size_t ringSize):
+    fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+    ringSize(ringSize),
+    ring(nullptr),
+    nextId(0),
+    connectionError(0)
+{
+    if (fd == -1)
+        throw std::system_error(errno, std::system_category(), buildCommittedFileReadError("socket", socketPath, errno).c_str());
+    const auto address(unixAddress(socketPath));
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1)
+    {
+        const int error(errno);
+        ::close(fd);
+        throw std::system_error(error, std::system_category(), buildCommittedFileReadError("connect", socketPath, error).c_str());
+    }
+
+    /**
+     * The daemon only maps rings that cannot shrink
+     */
+    const int ringFd(memfd_create("fsynctest-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    void* mapping(MAP_FAILED);
+    int error(errno);
+    if ((ringFd != -1) && (ftruncate(ringFd, static_cast<off_t>(ringSize)) == 0) &&
+        (fcntl(ringFd, F_ADD_SEALS, F_SEAL_SHRINK) == 0))
+        mapping = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, ringFd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        error = errno;
+        if (ringFd != -1)
+            ::close(ringFd);
+        ::close(fd);
+        throw std::system_error(error, std::system_category(), buildCommittedFileReadError("memfd_create", socketPath, error).c_str());
+    }
+    ring = static_cast<char*>(mapping);
+
+    const CommitRequest hello = { CommitRequestOp::HELLO, 0, 0, ringSize, 0 };
+    char byte(0);
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec iov = { &byte, 1 };
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header(CMSG_FIRSTHDR(&message));
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &ringFd, sizeof(ringFd));
+    const bool sent(sendAll(fd, &hello, sizeof(hello)) && (sendmsg(fd, &message, MSG_NOSIGNAL) == 1));
+    error = errno;
+    ::close(ringFd);
+    if (!sent)
+    {
+        munmap(ring, ringSize);
+        ::close(fd);
+        throw std::system_error(error, std::system_category(), buildCommittedFileReadError("sendmsg", socketPath, error).c_str());
+    }
+    receiver = std::thread(&CommitClient::receive, this);
+}
+
+CommitClient::~CommitClient()
+{
+    shutdown(fd, SHUT_RDWR);
+    receiver.join();
+    munmap(ring, ringSize);
+    ::close(fd);
+}
+
+uint64_t CommitClient::allocate(std::unique_lock<std::mutex>& lock, uint64_t length)
+{
+    for (;;)
+    {
+        if (connectionError)
+            return ringSize;
+        if (pending.empty())
+            return 0;
+        /**
+         * Entries are allocated in order, so the live ones form one
+         * range, possibly wrapped around the end
+         */
+        const uint64_t tail(pending.front().offset);
+        const uint64_t head(pending.back().offset + pending.back().length);
+        if (head > tail)
+        {
+            if (ringSize - head >= length)
+                return head;
+            if (tail > length)
+                return 0;
+        }
+        else if (tail - head >= length)
+            return head;
+        condition.wait(lock);
+    }
+}
+
+IoStatus CommitClient::commit(const std::string& path, const std::string& data)
 {
-    return filePath;
+    const uint64_t length(path.size() + data.size());
+    if (length > ringSize)
+        return IoStatus::failure("commit", "", path, "", EMSGSIZE);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    const uint64_t offset(allocate(lock, length));
+    if (connectionError)
+        return IoStatus::failure("commit", "", path, "", connectionError);
+    const uint64_t id(++nextId);
+    pending.push_back(Pending{ id, offset, length, false, false, 0 });
+    lock.unlock();
+
+    memcpy(ring + offset, path.data(), path.size());
+    memcpy(ring + offset + path.size(), data.data(), data.size());
+    const CommitRequest request = { CommitRequestOp::COMMIT, static_cast<uint32_t>(path.size()), id, offset, data.size() };
+    {
+        std::lock_guard<std::mutex> sendLock(sendMutex);
+        if (!sendAll(fd, &request, sizeof(request)))
+            /**
+             * The receiver notices the broken connection too and fails
+             * all pending commits, this one included
+             */
+            shutdown(fd, SHUT_RDWR);
+    }
+
+    lock.lock();
+    auto entry(pending.end());
+    condition.wait(lock, [&]()
+    {
+        entry = std::find_if(pending.begin(), pending.end(), [id](const Pending& p) { return p.id == id; });
+        return entry->done;
+    });
+    const int error(entry->error);
+    entry->collected = true;
+    while (!pending.empty() && pending.front().collected)
+        pending.pop_front();
+    lock.unlock();
+    condition.notify_all();
+
+    if (error)
+        return IoStatus::failure("commit", "", path, "", error);
+    return IoStatus();
+}
+
+void CommitClient::receive()
+{
+    CommitAck ack;
+    while (receiveAll(fd, &ack, sizeof(ack)))
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& entry: pending)
+            if (entry.id == ack.id)
+            {
+                entry.done = true;
+                entry.error = ack.error;
+            }
+        condition.notify_all();
+    }
+    const int error(errno ? errno : ECONNRESET);
+    std::lock_guard<std::mutex> lock(mutex);
+    connectionError = error;
+    for (auto& entry: pending)
+        if (!entry.done)
+        {
+            entry.done = true;
+            entry.error = error;
+        }
+    condition.notify_all();
 }